@@ -1,418 +1,101 @@
-#include <bits/stdc++.h>
-#include "bitmap_image.hpp"
-using namespace std;
+#include "2005110_pipeline.h"
 
 
-struct Point
-{
-    double x, y, z, w;
-    Point(double x = 0, double y = 0, double z = 0, double w = 1) : x(x), y(y), z(z), w(w) {}
-    void normalize()
-    {
-        x /= w;
-        y /= w;
-        z /= w;
-        w = 1;
-    }
-};
-
-struct Color
-{
-    int r, g, b;
-    Color(int r = 0, int g = 0, int b = 0) : r(r), g(g), b(b) {}
-};
-
-struct Triangle
-{
-    Point points[3];
-    Color color;
-};
-
-// ==== Matrix Utilities ====
-
-typedef vector<vector<double>> Matrix;
-
-Matrix identityMatrix()
-{
-    Matrix I(4, vector<double>(4, 0));
-    for (int i = 0; i < 4; i++)
-        I[i][i] = 1;
-    return I;
-}
-
-Point multiply(const Matrix &m, const Point &p)
-{
-    vector<double> vec = {p.x, p.y, p.z, p.w};
-    vector<double> res(4, 0);
-    for (int i = 0; i < 4; i++)
-        for (int j = 0; j < 4; j++)
-            res[i] += m[i][j] * vec[j];
-    return Point(res[0], res[1], res[2], res[3]);
-}
-
-Matrix multiply(const Matrix &a, const Matrix &b)
-{
-    Matrix res(4, vector<double>(4, 0));
-    for (int i = 0; i < 4; i++)
-        for (int j = 0; j < 4; j++)
-            for (int k = 0; k < 4; k++)
-                res[i][j] += a[i][k] * b[k][j];
-    return res;
-}
-
-Matrix translationMatrix(double tx, double ty, double tz)
-{
-    Matrix T = identityMatrix();
-    T[0][3] = tx;
-    T[1][3] = ty;
-    T[2][3] = tz;
-    return T;
-}
-
-Matrix scalingMatrix(double sx, double sy, double sz)
-{
-    Matrix S = identityMatrix();
-    S[0][0] = sx;
-    S[1][1] = sy;
-    S[2][2] = sz;
-    return S;
-}
-
-Point cross(const Point &a, const Point &b)
-{
-    return Point(
-        a.y * b.z - a.z * b.y,
-        a.z * b.x - a.x * b.z,
-        a.x * b.y - a.y * b.x);
-}
-
-double dot(const Point &a, const Point &b)
-{
-    return a.x * b.x + a.y * b.y + a.z * b.z;
-}
-
-Point normalize(const Point &a)
-{
-    double mag = sqrt(dot(a, a));
-    return Point(a.x / mag, a.y / mag, a.z / mag);
-}
-
-Point rodrigues(const Point &x, const Point &a, double angle)
-{
-    Point k = normalize(a);
-    double rad = angle * M_PI / 180.0;
-    Point term1 = Point(x.x * cos(rad), x.y * cos(rad), x.z * cos(rad));
-    Point term2 = Point(k.x * dot(k, x) * (1 - cos(rad)),
-                        k.y * dot(k, x) * (1 - cos(rad)),
-                        k.z * dot(k, x) * (1 - cos(rad)));
-    Point term3 = cross(k, x);
-    term3 = Point(term3.x * sin(rad), term3.y * sin(rad), term3.z * sin(rad));
-    return Point(term1.x + term2.x + term3.x,
-                 term1.y + term2.y + term3.y,
-                 term1.z + term2.z + term3.z);
-}
-
-Matrix rotationMatrix(double angle, double ax, double ay, double az)
-{
-    Point i(1, 0, 0), j(0, 1, 0), k(0, 0, 1), a(ax, ay, az);
-    Point c1 = rodrigues(i, a, angle);
-    Point c2 = rodrigues(j, a, angle);
-    Point c3 = rodrigues(k, a, angle);
-    Matrix R = identityMatrix();
-    R[0][0] = c1.x;
-    R[0][1] = c2.x;
-    R[0][2] = c3.x;
-    R[1][0] = c1.y;
-    R[1][1] = c2.y;
-    R[1][2] = c3.y;
-    R[2][0] = c1.z;
-    R[2][1] = c2.z;
-    R[2][2] = c3.z;
-    return R;
-}
-
-// ==== Stage 1: Modeling Transformation ====
-void stage1()
-{
-    ifstream in("scene.txt");
-    ofstream out("stage1.txt");
-    string cmd;
-    stack<Matrix> S;
-    S.push(identityMatrix());
-    while (in >> cmd)
+// ==== Main Function ====
+// usage: ./rasterizer [options]
+// scene.txt may also hold "mesh <file>" commands that load an .obj or .ply
+// mesh under the current matrix stack top
+//   default          runs stage1..stage4 through the stage1/2/3.txt files
+//   --fused          keeps vertices in memory and skips the stage files
+//   --debug-stages   with --fused, still writes stage1/2/3.txt
+//   --threads N      scan converts on N threads over screen tiles (0 = all cores)
+//   --tile S         tile edge in pixels for --threads (default 64)
+//   --raster R       scan conversion core: scanline (default), halfspace or fixed
+//   --hiz            hierarchical z culling of hidden triangles and 8x8 blocks
+//   --clip           clips triangles to the view volume before scan conversion
+//   --stage-format F stage files: text (default), bin (double) or bin32 (float)
+//   --depth-format F z-buffer storage: double (default), float32 or unorm24
+//   --zraw           also writes z-buffer.f32, the raw float32 depth buffer
+//   --stats F        writes stage timers and stage 4 counters to stats.json or stats.csv (F = json or csv)
+//   --heatmap        writes overdraw.bmp, the number of writes per pixel as a jet colormap
+//   --cull           with --fused, skips push/pop groups and instances whose bounding box is off screen
+//   --msaa N         N samples per pixel (2, 4 or 8) with the fixed-point coverage test
+//   --band ROWS      renders in horizontal bands of ROWS rows, streaming each into out.bmp and z-buffer.txt
+//   --triangle-parallel  with --threads, splits triangles (not screen tiles) over the threads,
+//                    resolving depth with compare-and-swap on a 64-bit depth+id word per pixel;
+//                    always the fixed-point core (--raster can only be fixed)
+//   --sort O         orders triangles front to back before scan conversion, to cut
+//                    overwritten pixels: scene (all at once) or tile (per tile list)
+//   --prepass        scan converts each batch twice: depth only, then color where the depth is equal
+//   --cameras FILE   renders out_<k>.bmp for every camera in FILE (camera, orbit and fly
+//                    commands; see Multi-Camera Rendering in 2005110_pipeline.h), running
+//                    stage 1 once for all of them; only --threads, --tile, --raster, --hiz,
+//                    --clip, --msaa, --depth-format, --sort and --prepass apply
+//   --convert IN OUT rewrites the binary stage file IN as text in OUT and exits
+//   --compare REF Z [TOL]  compares the z-buffer text file Z against REF row by row and exits,
+//                    failing if a row length differs or a value is off by more than TOL (default 1e-6)
+//   --check-depth-format F [TOL]  renders the scene with a double and an F z-buffer and exits,
+//                    failing if a pixel is covered in only one or differs by more than TOL (default 1e-6)
+//   --batch LIST     renders every scene directory listed in LIST (one per line) in this
+//                    process, writing the outputs into each directory, and prints throughput
+//   --jobs N         with --batch, scenes rendered at once (default: all cores); --threads
+//                    is then split between them
+//   --mem MB         with --batch, memory budget for the scenes in flight (default 2048)
+int main(int argc, char **argv)
+{
+    vector<string> args;
+    string batchList, checkFormat;
+    double checkTolerance = 1e-6;
+    int jobs = 0, memoryMB = 2048;
+    for (int i = 1; i < argc; i++)
     {
-        if (cmd == "triangle")
-        {
-            Point p[3];
-            for (int i = 0; i < 3; i++)
-            {
-                in >> p[i].x >> p[i].y >> p[i].z;
-                p[i].w = 1;
-                p[i] = multiply(S.top(), p[i]);
-                p[i].normalize();
-                out << fixed << setprecision(7)
-                    << p[i].x << " " << p[i].y << " " << p[i].z << "\n";
-            }
-            out << "\n";
-        }
-        else if (cmd == "translate")
-        {
-            double tx, ty, tz;
-            in >> tx >> ty >> tz;
-            Matrix T = translationMatrix(tx, ty, tz);
-            S.top() = multiply(S.top(), T);
-        }
-        else if (cmd == "scale")
-        {
-            double sx, sy, sz;
-            in >> sx >> sy >> sz;
-            Matrix S_new = scalingMatrix(sx, sy, sz);
-            S.top() = multiply(S.top(), S_new);
-        }
-        else if (cmd == "rotate")
-        {
-            double angle, ax, ay, az;
-            in >> angle >> ax >> ay >> az;
-            Matrix R = rotationMatrix(angle, ax, ay, az);
-            S.top() = multiply(S.top(), R);
-        }
-        else if (cmd == "push")
+        string arg = argv[i];
+        if (arg == "--convert" && i + 2 < argc)
         {
-            S.push(S.top());
+            string inFile = argv[i + 1], outFile = argv[i + 2];
+            return convertStageFile(inFile, outFile) ? 0 : 1;
         }
-        else if (cmd == "pop")
+        if (arg == "--compare" && i + 2 < argc)
         {
-            S.pop();
+            double tolerance = i + 3 < argc ? atof(argv[i + 3]) : 1e-6;
+            return compareZBufferFiles(argv[i + 1], argv[i + 2], tolerance) ? 0 : 1;
         }
-        else if (cmd == "end")
+        if (arg == "--check-depth-format" && i + 1 < argc)
         {
-            break;
+            checkFormat = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                checkTolerance = atof(argv[++i]);
         }
+        else if (arg == "--batch" && i + 1 < argc)
+            batchList = argv[++i];
+        else if (arg == "--jobs" && i + 1 < argc)
+            jobs = atoi(argv[++i]);
+        else if (arg == "--mem" && i + 1 < argc)
+            memoryMB = max(1, atoi(argv[++i]));
+        else
+            args.push_back(arg);
     }
-    in.close();
-    out.close();
-}
-
-// ==== Stage 2: View Transformation ====
-void stage2()
-{
-    ifstream config("scene.txt");
-    ifstream in("stage1.txt");
-    ofstream out("stage2.txt");
-
-    Point eye, look, up;
-    config >> eye.x >> eye.y >> eye.z;
-    config >> look.x >> look.y >> look.z;
-    config >> up.x >> up.y >> up.z;
-
-    Point l = normalize(Point(look.x - eye.x, look.y - eye.y, look.z - eye.z));
-    Point r = normalize(cross(l, up));
-    Point u = cross(r, l);
-
-    Matrix T = identityMatrix();
-    T[0][3] = -eye.x;
-    T[1][3] = -eye.y;
-    T[2][3] = -eye.z;
-
-    Matrix R = identityMatrix();
-    R[0][0] = r.x;
-    R[0][1] = r.y;
-    R[0][2] = r.z;
-    R[1][0] = u.x;
-    R[1][1] = u.y;
-    R[1][2] = u.z;
-    R[2][0] = -l.x;
-    R[2][1] = -l.y;
-    R[2][2] = -l.z;
 
-    Matrix V = multiply(R, T);
-
-    while (true)
+    RenderOptions opts;
+    if (!parseRenderOptions(args, opts))
+        return 1;
+    if (!checkFormat.empty())
     {
-        Point p[3];
-        for (int i = 0; i < 3; i++)
+        if (checkFormat != "float32" && checkFormat != "unorm24")
         {
-            if (!(in >> p[i].x >> p[i].y >> p[i].z))
-                return;
-            p[i].w = 1;
-            p[i] = multiply(V, p[i]);
-            p[i].normalize();
-            out << fixed << setprecision(7) << p[i].x << " " << p[i].y << " " << p[i].z << "\n";
+            cerr << "--check-depth-format takes float32 or unorm24\n";
+            return 1;
         }
-        out << "\n";
-    }
-
-    config.close();
-    in.close();
-    out.close();
-}
-
-// ==== Stage 3: Projection Transformation ====
-void stage3()
-{
-    ifstream config("scene.txt");
-    ifstream in("stage2.txt");
-    ofstream out("stage3.txt");
-
-    double trash;
-    for (int i = 0; i < 3 * 3; i++)
-        config >> trash; // skip eye, look, up
-
-    double fovY, aspectRatio, near, far;
-    config >> fovY >> aspectRatio >> near >> far;
-
-    double fovX = fovY * aspectRatio;
-    double t = near * tan((fovY * M_PI / 180.0) / 2.0);
-    double r = near * tan((fovX * M_PI / 180.0) / 2.0);
-
-    Matrix P(4, vector<double>(4, 0));
-    P[0][0] = near / r;
-    P[1][1] = near / t;
-    P[2][2] = -(far + near) / (far - near);
-    P[2][3] = -(2 * far * near) / (far - near);
-    P[3][2] = -1;
-
-    while (true)
-    {
-        Point p[3];
-        for (int i = 0; i < 3; i++)
-        {
-            if (!(in >> p[i].x >> p[i].y >> p[i].z))
-                return;
-            p[i].w = 1;
-            p[i] = multiply(P, p[i]);
-            p[i].normalize();
-            out << fixed << setprecision(7) << p[i].x << " " << p[i].y << " " << p[i].z << "\n";
-        }
-        out << "\n";
-    }
-
-    config.close();
-    in.close();
-    out.close();
-}
-
-// ==== Stage 4: Z-Buffer and Scan Conversion ====
-void stage4()
-{
-    ifstream config("config.txt");
-    ifstream in("stage3.txt");
-    ofstream zout("z-buffer.txt");
-
-    int screenWidth, screenHeight;
-    double x_left, y_bottom, z_front, z_rear;
-    config >> screenWidth >> screenHeight;
-    config >> x_left;
-    double x_right = -x_left;
-    config >> y_bottom;
-    double y_top = -y_bottom;
-    config >> z_front >> z_rear;
-
-    double dx = (x_right - x_left) / screenWidth;
-    double dy = (y_top - y_bottom) / screenHeight;
-    double topY = y_top - dy / 2;
-    double leftX = x_left + dx / 2;
-
-    vector<vector<double>> zBuffer(screenHeight, vector<double>(screenWidth, z_rear));
-    bitmap_image image(screenWidth, screenHeight);
-    image.set_all_channels(0, 0, 0);
-
-    vector<Triangle> triangles;
-    Point p;
-    while (in >> p.x >> p.y >> p.z)
-    {
-        Point a = p;
-        in >> p.x >> p.y >> p.z;
-        Point b = p;
-        in >> p.x >> p.y >> p.z;
-        Point c = p;
-
-        Triangle tri;
-        tri.points[0] = a;
-        tri.points[1] = b;
-        tri.points[2] = c;
-        tri.color = Color(rand() % 256, rand() % 256, rand() % 256);
-        triangles.push_back(tri);
+        return checkDepthFormat(opts, checkFormat, checkTolerance) ? 0 : 1;
     }
-
-    for (auto &tri : triangles)
+    if (!batchList.empty())
     {
-        double minY = min({tri.points[0].y, tri.points[1].y, tri.points[2].y});
-        double maxY = max({tri.points[0].y, tri.points[1].y, tri.points[2].y});
-
-        int topScan = max(0, (int)ceil((topY - maxY) / dy));
-        int bottomScan = min(screenHeight - 1, (int)floor((topY - minY) / dy));
-
-        for (int row = topScan; row <= bottomScan; row++)
-        {
-            double scanY = topY - row * dy;
-
-            vector<double> xints;
-            vector<double> zvals;
-            for (int i = 0; i < 3; i++)
-            {
-                Point p1 = tri.points[i];
-                Point p2 = tri.points[(i + 1) % 3];
-                if ((p1.y <= scanY && p2.y >= scanY) || (p2.y <= scanY && p1.y >= scanY))
-                {
-                    if (p1.y != p2.y)
-                    {
-                        double x = p1.x + (scanY - p1.y) * (p2.x - p1.x) / (p2.y - p1.y);
-                        double z = p1.z + (scanY - p1.y) * (p2.z - p1.z) / (p2.y - p1.y);
-                        xints.push_back(x);
-                        zvals.push_back(z);
-                    }
-                }
-            }
-
-            if (xints.size() < 2)
-                continue;
-            double xl = min(xints[0], xints[1]);
-            double xr = max(xints[0], xints[1]);
-            double zl = xints[0] < xints[1] ? zvals[0] : zvals[1];
-            double zr = xints[0] < xints[1] ? zvals[1] : zvals[0];
-
-            int leftCol = max(0, (int)ceil((xl - leftX) / dx));
-            int rightCol = min(screenWidth - 1, (int)floor((xr - leftX) / dx));
-
-            for (int col = leftCol; col <= rightCol; col++)
-            {
-                double scanX = leftX + col * dx;
-                double z = zl + (scanX - xl) * (zr - zl) / (xr - xl);
-
-                if (z >= z_front && z < zBuffer[row][col])
-                {
-                    zBuffer[row][col] = z;
-                    image.set_pixel(col, row, tri.color.r, tri.color.g, tri.color.b);
-                }
-            }
-        }
-    }
-
-    for (int i = 0; i < screenHeight; i++) {
-        bool first = true;
-        for (int j = 0; j < screenWidth; j++) {
-            if (zBuffer[i][j] < z_rear) {
-                if (!first) zout << "\t";
-                zout << fixed << setprecision(6) << zBuffer[i][j];
-                first = false;
-            }
-        }
-        zout << "\n";
+        vector<string> dirs;
+        if (!readBatchList(batchList, dirs))
+            return 1;
+        if (jobs <= 0)
+            jobs = max(1u, thread::hardware_concurrency());
+        return runBatch(dirs, opts, jobs, (size_t)memoryMB << 20) ? 0 : 1;
     }
-
-    image.save_image("out.bmp");
-    config.close();
-    in.close();
-    zout.close();
-}
-
-// ==== Main Function ====
-int main()
-{
-    stage1();
-    stage2();
-    stage3();
-    stage4();
-    return 0;
+    return runPipeline(opts) ? 0 : 1;
 }
@@ -0,0 +1,232 @@
+#include "2005110_pipeline.h"
+
+
+// ==== Scene Generator ====
+// Writes a scene.txt/config.txt pair for the pipeline. Triangles are spread
+// over the whole view at depths around the look-at point; their mean screen
+// area follows from the requested depth complexity (average number of
+// triangles covering a pixel) unless an explicit area is given.
+
+struct BenchScene
+{
+    long long triangles = 100000;
+    int width = 1920, height = 1080;
+    double depth = 4;             // average triangles per pixel
+    double area = 0;              // mean triangle area in pixels (0 = from depth)
+    string sizeDist = "fixed";    // fixed, uniform or lognormal
+    int nesting = 2;              // push/pop levels around each group
+    int group = 64;               // triangles per push/pop group
+    unsigned seed = 1;
+};
+
+const double BENCH_EYE_Z = 50;
+
+void generateScene(BenchScene &scene, const string &dir)
+{
+    mt19937_64 rng(scene.seed);
+    uniform_real_distribution<double> unit(0, 1);
+    normal_distribution<double> gauss(0, 1);
+
+    double aspect = (double)scene.width / scene.height;
+    double fovY = min(45.0, 90.0 / aspect);
+    double halfY = BENCH_EYE_Z * tan(fovY * M_PI / 360);
+    double halfX = BENCH_EYE_Z * tan(fovY * aspect * M_PI / 360);
+    double pixelsPerArea = (scene.width / (2 * halfX)) * (scene.height / (2 * halfY));
+    double screenPixels = (double)scene.width * scene.height;
+    if (scene.area > 0)
+        scene.depth = scene.triangles * scene.area / screenPixels;
+    else
+        scene.area = scene.depth * screenPixels / max(1LL, scene.triangles);
+
+    ofstream config(dir + "/config.txt");
+    config << scene.width << " " << scene.height << "\n-1\n-1\n0 2\n";
+
+    FILE *out = fopen((dir + "/scene.txt").c_str(), "w");
+    fprintf(out, "0.0 0.0 %.1f\n0.0 0.0 0.0\n0.0 1.0 0.0\n%.4f %.4f 1.0 100.0\n", BENCH_EYE_Z, fovY, aspect);
+    for (long long t = 0; t < scene.triangles; t++)
+    {
+        bool groupStart = t % scene.group == 0;
+        if (groupStart && t > 0)
+            for (int k = 0; k < scene.nesting; k++)
+                fprintf(out, "pop\n");
+        if (groupStart)
+            for (int k = 0; k < scene.nesting; k++)
+                fprintf(out, "push\ntranslate\n%.4f %.4f 0.0\nrotate\n%.4f 0.0 0.0 1.0\n",
+                        (unit(rng) - 0.5) * 0.1 * halfX, (unit(rng) - 0.5) * 0.1 * halfY, (unit(rng) - 0.5) * 20);
+
+        double a = scene.area;
+        if (scene.sizeDist == "uniform")
+            a *= 2 * unit(rng);
+        else if (scene.sizeDist == "lognormal")
+            a *= exp(gauss(rng) - 0.5);
+        // vertices on a circle, roughly 120 degrees apart
+        double r = sqrt(4 * (a / pixelsPerArea) / (3 * sqrt(3.0)));
+        double cx = (2 * unit(rng) - 1) * halfX, cy = (2 * unit(rng) - 1) * halfY, cz = (2 * unit(rng) - 1) * 10;
+        double angle = unit(rng) * 2 * M_PI;
+        fprintf(out, "triangle\n");
+        for (int i = 0; i < 3; i++)
+        {
+            double th = angle + i * 2 * M_PI / 3 + (unit(rng) - 0.5) * 0.5;
+            fprintf(out, "%.4f %.4f %.4f\n", cx + r * cos(th), cy + r * sin(th), cz + (unit(rng) - 0.5) * r);
+        }
+    }
+    if (scene.triangles > 0)
+        for (int k = 0; k < scene.nesting; k++)
+            fprintf(out, "pop\n");
+    fprintf(out, "end\n");
+    fclose(out);
+}
+
+// ==== Timing ====
+
+struct StageTimes
+{
+    vector<string> names;
+    vector<vector<double>> seconds; // seconds[stage][run]
+
+    void add(int stage, const string &name, double s)
+    {
+        if (stage == (int)names.size())
+        {
+            names.push_back(name);
+            seconds.emplace_back();
+        }
+        seconds[stage].push_back(s);
+    }
+};
+
+// one pipeline run in opts.dir through runPipeline, so every rasterizer
+// option applies; the whole-stage timers it keeps (stage1..stage4, fused or
+// cameras) are recorded, not their parts such as stage4_raster
+bool benchRun(const RenderOptions &opts, StageTimes &times)
+{
+    srand(1);
+    if (!runPipeline(opts))
+        return false;
+    int stage = 0;
+    for (auto &t : pipelineStats.timers)
+        if (t.first.find('_') == string::npos)
+            times.add(stage++, t.first, t.second);
+    return true;
+}
+
+// ==== JSON Report ====
+
+void writeReport(ostream &out, const BenchScene &scene, const vector<string> &rasterArgs, int runs, const StageTimes &times)
+{
+    out << fixed << setprecision(6);
+    out << "{\n";
+    out << "  \"scene\": {\"triangles\": " << scene.triangles << ", \"width\": " << scene.width
+        << ", \"height\": " << scene.height << ", \"depth_complexity\": " << scene.depth
+        << ", \"mean_area_px\": " << scene.area << ", \"size_dist\": \"" << scene.sizeDist
+        << "\", \"nesting\": " << scene.nesting << ", \"seed\": " << scene.seed << "},\n";
+    out << "  \"options\": [";
+    for (size_t i = 0; i < rasterArgs.size(); i++)
+        out << (i ? ", " : "") << "\"" << rasterArgs[i] << "\"";
+    out << "],\n";
+    out << "  \"runs\": " << runs << ",\n";
+    out << "  \"stages\": {\n";
+    vector<double> totals(runs, 0);
+    for (size_t s = 0; s < times.names.size(); s++)
+    {
+        const vector<double> &v = times.seconds[s];
+        for (int r = 0; r < runs; r++)
+            totals[r] += v[r];
+        double best = *min_element(v.begin(), v.end());
+        double mean = accumulate(v.begin(), v.end(), 0.0) / v.size();
+        out << "    \"" << times.names[s] << "\": {\"min_s\": " << best << ", \"mean_s\": " << mean
+            << ", \"triangles_per_sec\": " << scene.triangles / best << "}"
+            << (s + 1 < times.names.size() ? "," : "") << "\n";
+    }
+    out << "  },\n";
+    double best = *min_element(totals.begin(), totals.end());
+    out << "  \"total_min_s\": " << best << ",\n";
+    out << "  \"triangles_per_sec\": " << scene.triangles / best << ",\n";
+    out << "  \"pixels_per_sec\": " << (double)scene.width * scene.height / best << "\n";
+    out << "}\n";
+}
+
+// ==== Main Function ====
+// usage: ./bench [bench options] [-- rasterizer options]
+//   --triangles N    triangle count (default 100000)
+//   --size W H       screen size (default 1920 1080)
+//   --depth D        depth complexity, average triangles per pixel (default 4)
+//   --area A         mean triangle area in pixels; overrides --depth
+//   --size-dist S    triangle area distribution: fixed (default), uniform or lognormal
+//   --nesting K      push/pop levels around every group of 64 triangles (default 2)
+//   --seed S         generator seed (default 1)
+//   --runs R         timed pipeline runs (default 3)
+//   --dir D          directory for the generated scene and outputs (default bench_scene)
+//   --json F         write the report to F instead of stdout
+// Everything after -- is passed to the pipeline as rasterizer options.
+int main(int argc, char **argv)
+{
+    BenchScene scene;
+    int runs = 3;
+    string dir = "bench_scene", jsonFile;
+    vector<string> rasterArgs;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--")
+        {
+            rasterArgs.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else if (arg == "--triangles" && hasValue)
+            scene.triangles = max(0LL, atoll(argv[++i]));
+        else if (arg == "--size" && i + 2 < argc)
+        {
+            scene.width = max(1, atoi(argv[++i]));
+            scene.height = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--depth" && hasValue)
+            scene.depth = atof(argv[++i]);
+        else if (arg == "--area" && hasValue)
+            scene.area = atof(argv[++i]);
+        else if (arg == "--size-dist" && hasValue)
+            scene.sizeDist = argv[++i];
+        else if (arg == "--nesting" && hasValue)
+            scene.nesting = max(0, atoi(argv[++i]));
+        else if (arg == "--seed" && hasValue)
+            scene.seed = atoi(argv[++i]);
+        else if (arg == "--runs" && hasValue)
+            runs = max(1, atoi(argv[++i]));
+        else if (arg == "--dir" && hasValue)
+            dir = argv[++i];
+        else if (arg == "--json" && hasValue)
+            jsonFile = argv[++i];
+        else
+        {
+            cerr << "unknown option: " << arg << "\n";
+            return 1;
+        }
+    }
+    if (scene.sizeDist != "fixed" && scene.sizeDist != "uniform" && scene.sizeDist != "lognormal")
+    {
+        cerr << "unknown size distribution: " << scene.sizeDist << "\n";
+        return 1;
+    }
+    RenderOptions opts;
+    if (!parseRenderOptions(rasterArgs, opts))
+        return 1;
+
+    filesystem::create_directories(dir);
+    generateScene(scene, dir);
+
+    opts.dir = dir;
+    StageTimes times;
+    for (int r = 0; r < runs; r++)
+        if (!benchRun(opts, times))
+            return 1;
+
+    if (jsonFile.empty())
+        writeReport(cout, scene, rasterArgs, runs, times);
+    else
+    {
+        ofstream json(jsonFile);
+        writeReport(json, scene, rasterArgs, runs, times);
+    }
+    return 0;
+}
@@ -0,0 +1,188 @@
+#ifndef INCLUDE_2005110_MATRIX_H
+#define INCLUDE_2005110_MATRIX_H
+
+#include <cmath>
+#include <cstddef>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// ==== Vec4 / Mat4 ====
+// Fixed-size homogeneous point and 4x4 matrix. Both live on the stack, so
+// transforming a vertex never touches the heap. The matrix is stored by
+// column so the SIMD kernels can broadcast one point coordinate and
+// multiply a whole column; the sums are accumulated in the same order as
+// the plain row * column loops, so the results match them bit for bit.
+
+struct alignas(16) Vec4
+{
+    double x, y, z, w;
+    constexpr Vec4(double x = 0, double y = 0, double z = 0, double w = 1) : x(x), y(y), z(z), w(w) {}
+    void normalize()
+    {
+        x /= w;
+        y /= w;
+        z /= w;
+        w = 1;
+    }
+};
+
+typedef Vec4 Point;
+
+struct alignas(16) Mat4
+{
+    double c[4][4]; // c[col][row]
+
+    constexpr Mat4() : c{} {}
+    constexpr double operator()(int row, int col) const { return c[col][row]; }
+    constexpr double &operator()(int row, int col) { return c[col][row]; }
+};
+
+constexpr Mat4 identityMatrix()
+{
+    Mat4 I;
+    for (int i = 0; i < 4; i++)
+        I(i, i) = 1;
+    return I;
+}
+
+constexpr Mat4 translationMatrix(double tx, double ty, double tz)
+{
+    Mat4 T = identityMatrix();
+    T(0, 3) = tx;
+    T(1, 3) = ty;
+    T(2, 3) = tz;
+    return T;
+}
+
+constexpr Mat4 scalingMatrix(double sx, double sy, double sz)
+{
+    Mat4 S = identityMatrix();
+    S(0, 0) = sx;
+    S(1, 1) = sy;
+    S(2, 2) = sz;
+    return S;
+}
+
+// ==== SIMD Kernels ====
+
+// out[i] = m * in[i] for n records of four doubles; in and out may alias
+inline void transform4(const Mat4 &m, const double *in, double *out, size_t n)
+{
+#if defined(__AVX__)
+    __m256d c0 = _mm256_loadu_pd(m.c[0]), c1 = _mm256_loadu_pd(m.c[1]);
+    __m256d c2 = _mm256_loadu_pd(m.c[2]), c3 = _mm256_loadu_pd(m.c[3]);
+    for (size_t i = 0; i < n; i++, in += 4, out += 4)
+    {
+        __m256d r = _mm256_mul_pd(c0, _mm256_broadcast_sd(in));
+        r = _mm256_add_pd(r, _mm256_mul_pd(c1, _mm256_broadcast_sd(in + 1)));
+        r = _mm256_add_pd(r, _mm256_mul_pd(c2, _mm256_broadcast_sd(in + 2)));
+        r = _mm256_add_pd(r, _mm256_mul_pd(c3, _mm256_broadcast_sd(in + 3)));
+        _mm256_storeu_pd(out, r);
+    }
+#elif defined(__SSE2__)
+    __m128d c0l = _mm_load_pd(&m.c[0][0]), c0h = _mm_load_pd(&m.c[0][2]);
+    __m128d c1l = _mm_load_pd(&m.c[1][0]), c1h = _mm_load_pd(&m.c[1][2]);
+    __m128d c2l = _mm_load_pd(&m.c[2][0]), c2h = _mm_load_pd(&m.c[2][2]);
+    __m128d c3l = _mm_load_pd(&m.c[3][0]), c3h = _mm_load_pd(&m.c[3][2]);
+    for (size_t i = 0; i < n; i++, in += 4, out += 4)
+    {
+        __m128d x = _mm_set1_pd(in[0]), y = _mm_set1_pd(in[1]);
+        __m128d z = _mm_set1_pd(in[2]), w = _mm_set1_pd(in[3]);
+        __m128d lo = _mm_mul_pd(c0l, x), hi = _mm_mul_pd(c0h, x);
+        lo = _mm_add_pd(lo, _mm_mul_pd(c1l, y));
+        hi = _mm_add_pd(hi, _mm_mul_pd(c1h, y));
+        lo = _mm_add_pd(lo, _mm_mul_pd(c2l, z));
+        hi = _mm_add_pd(hi, _mm_mul_pd(c2h, z));
+        lo = _mm_add_pd(lo, _mm_mul_pd(c3l, w));
+        hi = _mm_add_pd(hi, _mm_mul_pd(c3h, w));
+        _mm_storeu_pd(out, lo);
+        _mm_storeu_pd(out + 2, hi);
+    }
+#else
+    for (size_t i = 0; i < n; i++, in += 4, out += 4)
+    {
+        double x = in[0], y = in[1], z = in[2], w = in[3];
+        for (int r = 0; r < 4; r++)
+            out[r] = m.c[0][r] * x + m.c[1][r] * y + m.c[2][r] * z + m.c[3][r] * w;
+    }
+#endif
+}
+
+// batched point transform: out[i] = m * in[i]
+inline void transformPoints(const Mat4 &m, const Vec4 *in, Vec4 *out, size_t n)
+{
+    transform4(m, &in->x, &out->x, n);
+}
+
+inline Vec4 multiply(const Mat4 &m, const Vec4 &p)
+{
+    Vec4 res;
+    transformPoints(m, &p, &res, 1);
+    return res;
+}
+
+// column j of a * b is a * (column j of b)
+inline Mat4 multiply(const Mat4 &a, const Mat4 &b)
+{
+    Mat4 res;
+    transform4(a, b.c[0], res.c[0], 4);
+    return res;
+}
+
+// ==== Vector Helpers and Rotation ====
+
+inline Point cross(const Point &a, const Point &b)
+{
+    return Point(
+        a.y * b.z - a.z * b.y,
+        a.z * b.x - a.x * b.z,
+        a.x * b.y - a.y * b.x);
+}
+
+inline double dot(const Point &a, const Point &b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Point normalize(const Point &a)
+{
+    double mag = sqrt(dot(a, a));
+    return Point(a.x / mag, a.y / mag, a.z / mag);
+}
+
+inline Point rodrigues(const Point &x, const Point &a, double angle)
+{
+    Point k = normalize(a);
+    double rad = angle * M_PI / 180.0;
+    Point term1 = Point(x.x * cos(rad), x.y * cos(rad), x.z * cos(rad));
+    Point term2 = Point(k.x * dot(k, x) * (1 - cos(rad)),
+                        k.y * dot(k, x) * (1 - cos(rad)),
+                        k.z * dot(k, x) * (1 - cos(rad)));
+    Point term3 = cross(k, x);
+    term3 = Point(term3.x * sin(rad), term3.y * sin(rad), term3.z * sin(rad));
+    return Point(term1.x + term2.x + term3.x,
+                 term1.y + term2.y + term3.y,
+                 term1.z + term2.z + term3.z);
+}
+
+inline Mat4 rotationMatrix(double angle, double ax, double ay, double az)
+{
+    Point i(1, 0, 0), j(0, 1, 0), k(0, 0, 1), a(ax, ay, az);
+    Point c1 = rodrigues(i, a, angle);
+    Point c2 = rodrigues(j, a, angle);
+    Point c3 = rodrigues(k, a, angle);
+    Mat4 R = identityMatrix();
+    R(0, 0) = c1.x;
+    R(0, 1) = c2.x;
+    R(0, 2) = c3.x;
+    R(1, 0) = c1.y;
+    R(1, 1) = c2.y;
+    R(1, 2) = c3.y;
+    R(2, 0) = c1.z;
+    R(2, 1) = c2.z;
+    R(2, 2) = c3.z;
+    return R;
+}
+
+#endif
@@ -0,0 +1,4214 @@
+#ifndef INCLUDE_2005110_PIPELINE_H
+#define INCLUDE_2005110_PIPELINE_H
+
+// The rasterizer pipeline: stages 1-4, their options and file formats.
+// Shared by the rasterizer (2005110.cpp) and the benchmark
+// (2005110_bench.cpp); it holds definitions, so include it from one
+// translation unit per program.
+
+#include <bits/stdc++.h>
+#include "bitmap_image.hpp"
+#include "2005110_matrix.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#endif
+using namespace std;
+
+
+struct Color
+{
+    int r, g, b;
+    Color(int r = 0, int g = 0, int b = 0) : r(r), g(g), b(b) {}
+};
+
+struct Triangle
+{
+    Point points[3];
+    Color color;
+};
+
+// ==== Triangle Colors ====
+// Colors come from rand(), three calls per triangle in scene order. Batch
+// jobs share one process, so each job thread gets its own copy of glibc's
+// random() (the additive feedback generator behind rand()), seeded like a
+// fresh process; with glibc a scene gets the same colors in a batch as when
+// rendered alone.
+
+struct ColorRandom
+{
+    uint32_t r[34];
+    int i = 0; // slot of the next value; i + 3 is r[n - 31], i + 31 is r[n - 3]
+
+    explicit ColorRandom(int32_t seed = 1)
+    {
+        r[0] = seed;
+        for (int k = 1; k < 31; k++)
+        {
+            long long v = 16807LL * (int32_t)r[k - 1] % 2147483647;
+            r[k] = v < 0 ? v + 2147483647 : v;
+        }
+        for (int k = 31; k < 34; k++)
+            r[k] = r[k - 31];
+        for (int k = 0; k < 310; k++)
+            next();
+    }
+
+    int next()
+    {
+        uint32_t v = r[(i + 3) % 34] + r[(i + 31) % 34];
+        r[i] = v;
+        i = (i + 1) % 34;
+        return v >> 1;
+    }
+};
+
+thread_local ColorRandom *jobColors = nullptr; // set by the batch driver
+
+inline int colorRand()
+{
+    return jobColors ? jobColors->next() : rand();
+}
+
+// ==== Render Options ====
+
+struct RenderOptions
+{
+    bool fused = false;       // run stages 1-3 in memory
+    bool debugStages = false; // with fused, still write stage1/2/3.txt
+    int threads = 1;          // > 1 bins triangles into tiles for stage 4
+    int tileSize = 64;        // tile edge in pixels for the binned path
+    string raster = "scanline"; // scan conversion core: scanline, halfspace or fixed
+    bool hiz = false;         // hierarchical z occlusion culling
+    bool clip = false;        // clip against the view volume before stage 4
+    string stageFormat = "text"; // stage files: text, bin (double) or bin32 (float)
+    bool zRaw = false;        // also dump the depth buffer as raw float32
+    string stats;             // counter report at exit: json, csv or empty for none
+    bool heatmap = false;     // write overdraw.bmp (implies counting)
+    bool cull = false;        // skip push/pop groups and instances that are off screen (fused)
+    string cameras;           // camera list file: render out_<k>.bmp per camera instead
+    int msaa = 1;             // samples per pixel: 1, 2, 4 or 8
+    int bandRows = 0;         // > 0: render in horizontal bands of this many rows
+    string depthFormat = "double"; // z-buffer storage: double, float32 or unorm24
+    bool triangleParallel = false; // split stage 4 by triangles over an atomic depth+id buffer
+    string sort;              // front-to-back ordering before stage 4: scene, tile or empty for file order
+    bool prepass = false;     // stage 4 in a depth-only pass, then a color pass at equal depth
+    string dir;               // directory of scene.txt, config.txt and the outputs; empty = working directory
+};
+
+// name inside dir (names that are already absolute are left alone)
+string inDir(const string &dir, const string &name)
+{
+    if (dir.empty() || name.empty() || name[0] == '/')
+        return name;
+    return dir + "/" + name;
+}
+
+// ==== Mapped Files and Scene Scanner ====
+
+// read-only view of a whole file: memory mapped where the platform allows
+// it, otherwise read into memory
+struct MappedFile
+{
+    const char *data = nullptr;
+    size_t size = 0;
+    void *mapped = nullptr;
+    vector<char> fallback;
+
+    MappedFile() {}
+    explicit MappedFile(const string &file)
+    {
+#ifdef HAVE_MMAP
+        int fd = ::open(file.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED)
+            {
+                madvise(m, st.st_size, MADV_SEQUENTIAL);
+                mapped = m;
+                size = st.st_size;
+                data = (const char *)m;
+            }
+        }
+        if (fd >= 0)
+            ::close(fd);
+#endif
+        if (!data)
+        {
+            ifstream f(file, ios::binary);
+            fallback.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+            size = fallback.size();
+            data = fallback.data();
+        }
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile()
+    {
+#ifdef HAVE_MMAP
+        if (mapped)
+            munmap(mapped, size);
+#endif
+    }
+};
+
+// whitespace-separated tokens of scene.txt (and the text stage files and
+// mesh lines) straight from the mapped file or a range of memory; numbers
+// are parsed with from_chars, so nothing is copied or allocated
+struct SceneScanner
+{
+    MappedFile file;
+    const char *pos, *end;
+
+    explicit SceneScanner(const string &path) : file(path), pos(file.data), end(file.data + file.size) {}
+    SceneScanner(const char *begin, const char *end) : file(), pos(begin), end(end) {}
+
+    void skipSpace()
+    {
+        while (pos < end && isspace((unsigned char)*pos))
+            pos++;
+    }
+
+    bool word(string_view &w)
+    {
+        skipSpace();
+        const char *start = pos;
+        while (pos < end && !isspace((unsigned char)*pos))
+            pos++;
+        w = string_view(start, pos - start);
+        return pos > start;
+    }
+
+    bool number(double &v)
+    {
+        skipSpace();
+        const char *start = pos < end && *pos == '+' ? pos + 1 : pos;
+        from_chars_result r = from_chars(start, end, v);
+        if (r.ec != errc())
+        {
+            v = 0;
+            return false;
+        }
+        pos = r.ptr;
+        return true;
+    }
+
+    bool point(Point &p)
+    {
+        return number(p.x) && number(p.y) && number(p.z);
+    }
+};
+
+// ==== Scene Header and Screen Config ====
+
+struct Camera
+{
+    Point eye, look, up;
+    double fovY, aspectRatio, near, far;
+};
+
+// reads the four header lines of scene.txt (eye, look, up, perspective)
+Camera readCamera(SceneScanner &in)
+{
+    Camera cam;
+    in.point(cam.eye);
+    in.point(cam.look);
+    in.point(cam.up);
+    in.number(cam.fovY) && in.number(cam.aspectRatio) && in.number(cam.near) && in.number(cam.far);
+    return cam;
+}
+
+Mat4 viewMatrix(const Camera &cam)
+{
+    Point l = normalize(Point(cam.look.x - cam.eye.x, cam.look.y - cam.eye.y, cam.look.z - cam.eye.z));
+    Point r = normalize(cross(l, cam.up));
+    Point u = cross(r, l);
+
+    Mat4 T = identityMatrix();
+    T(0, 3) = -cam.eye.x;
+    T(1, 3) = -cam.eye.y;
+    T(2, 3) = -cam.eye.z;
+
+    Mat4 R = identityMatrix();
+    R(0, 0) = r.x;
+    R(0, 1) = r.y;
+    R(0, 2) = r.z;
+    R(1, 0) = u.x;
+    R(1, 1) = u.y;
+    R(1, 2) = u.z;
+    R(2, 0) = -l.x;
+    R(2, 1) = -l.y;
+    R(2, 2) = -l.z;
+
+    return multiply(R, T);
+}
+
+Mat4 projectionMatrix(const Camera &cam)
+{
+    double fovX = cam.fovY * cam.aspectRatio;
+    double t = cam.near * tan((cam.fovY * M_PI / 180.0) / 2.0);
+    double r = cam.near * tan((fovX * M_PI / 180.0) / 2.0);
+
+    Mat4 P;
+    P(0, 0) = cam.near / r;
+    P(1, 1) = cam.near / t;
+    P(2, 2) = -(cam.far + cam.near) / (cam.far - cam.near);
+    P(2, 3) = -(2 * cam.far * cam.near) / (cam.far - cam.near);
+    P(3, 2) = -1;
+    return P;
+}
+
+struct ScreenConfig
+{
+    int width, height;
+    double x_left, x_right, y_bottom, y_top, z_front, z_rear;
+    double dx, dy, topY, leftX;
+};
+
+// the config.txt values; the window is symmetric about the origin
+ScreenConfig makeScreenConfig(int width, int height, double x_left, double y_bottom, double z_front, double z_rear)
+{
+    ScreenConfig sc;
+    sc.width = width;
+    sc.height = height;
+    sc.x_left = x_left;
+    sc.x_right = -x_left;
+    sc.y_bottom = y_bottom;
+    sc.y_top = -y_bottom;
+    sc.z_front = z_front;
+    sc.z_rear = z_rear;
+
+    sc.dx = (sc.x_right - sc.x_left) / sc.width;
+    sc.dy = (sc.y_top - sc.y_bottom) / sc.height;
+    sc.topY = sc.y_top - sc.dy / 2;
+    sc.leftX = sc.x_left + sc.dx / 2;
+    return sc;
+}
+
+ScreenConfig readScreenConfig(const string &file)
+{
+    ifstream config(file);
+    int width = 0, height = 0;
+    double x_left = 0, y_bottom = 0, z_front = 0, z_rear = 0;
+    config >> width >> height >> x_left >> y_bottom >> z_front >> z_rear;
+    return makeScreenConfig(width, height, x_left, y_bottom, z_front, z_rear);
+}
+
+void writeStagePoint(ofstream &out, const Point &p)
+{
+    out << fixed << setprecision(7) << p.x << " " << p.y << " " << p.z << "\n";
+}
+
+// ==== Stage Files ====
+// Stages 1-3 hand triangles to the next stage through stageN.txt, or with a
+// binary stage format through stageN.bin:
+//   header  char magic[4] = "STG\0", uint32 version = 1, uint32 stage,
+//           uint32 scalar bytes (4 or 8), uint64 triangle count  (24 bytes)
+//   records count * 9 scalars (x y z of the three vertices), little endian
+// Binary files are memory mapped by the reader where the platform allows it.
+
+struct StageHeader
+{
+    char magic[4];
+    uint32_t version, stage, scalarBytes;
+    uint64_t count;
+};
+
+const char STAGE_MAGIC[4] = {'S', 'T', 'G', '\0'};
+const uint32_t STAGE_VERSION = 1;
+
+string stageFileName(int stage, const string &format, const string &dir = "")
+{
+    return inDir(dir, "stage" + to_string(stage) + (format == "text" ? ".txt" : ".bin"));
+}
+
+struct StageWriter
+{
+    ofstream out;
+    bool binary = false;
+    StageHeader header;
+
+    StageWriter(int stage, const string &format, const string &dir = "")
+    {
+        binary = format != "text";
+        out.open(stageFileName(stage, format, dir), binary ? ios::binary : ios::out);
+        if (binary)
+        {
+            memcpy(header.magic, STAGE_MAGIC, 4);
+            header.version = STAGE_VERSION;
+            header.stage = stage;
+            header.scalarBytes = format == "bin32" ? 4 : 8;
+            header.count = 0;
+            out.write((const char *)&header, sizeof header);
+        }
+    }
+    ~StageWriter() { close(); }
+
+    void write(const Point p[3])
+    {
+        if (!binary)
+        {
+            for (int i = 0; i < 3; i++)
+                writeStagePoint(out, p[i]);
+            out << "\n";
+            return;
+        }
+        double d[9] = {p[0].x, p[0].y, p[0].z, p[1].x, p[1].y, p[1].z, p[2].x, p[2].y, p[2].z};
+        if (header.scalarBytes == 4)
+        {
+            float f[9];
+            for (int i = 0; i < 9; i++)
+                f[i] = (float)d[i];
+            out.write((const char *)f, sizeof f);
+        }
+        else
+            out.write((const char *)d, sizeof d);
+        header.count++;
+    }
+
+    // patches the triangle count into the header
+    void close()
+    {
+        if (!out.is_open())
+            return;
+        if (binary)
+        {
+            out.seekp(0);
+            out.write((const char *)&header, sizeof header);
+        }
+        out.close();
+    }
+};
+
+struct StageReader
+{
+    unique_ptr<SceneScanner> text; // text files
+    bool binary = false;
+    StageHeader header{};
+    unique_ptr<MappedFile> file; // binary files
+    const char *records = nullptr;
+    uint64_t next = 0;
+    string path;
+    bool ok = true; // false once the file is missing, its header bad or a text record cut short
+
+    StageReader(int stage, const string &format, const string &dir = "") : StageReader(stageFileName(stage, format, dir)) {}
+
+    // the format is taken from the file itself: a STG header means binary
+    explicit StageReader(const string &path) : path(path)
+    {
+        ifstream probe(path, ios::binary);
+        if (!probe)
+        {
+            cerr << "cannot open " << path << "\n";
+            ok = false;
+            return;
+        }
+        char magic[4] = {};
+        probe.read(magic, 4);
+        binary = probe.gcount() == 4 && memcmp(magic, STAGE_MAGIC, 4) == 0;
+        probe.close();
+        if (!binary)
+        {
+            text.reset(new SceneScanner(path));
+            return;
+        }
+        file.reset(new MappedFile(path));
+        size_t bytes = file->size;
+        const char *data = file->data;
+        if (bytes < sizeof header)
+        {
+            cerr << path << ": bad stage header\n";
+            ok = false;
+            return;
+        }
+        memcpy(&header, data, sizeof header);
+        uint64_t fits = (bytes - sizeof header) / (9 * max<uint32_t>(header.scalarBytes, 1));
+        if (header.version != STAGE_VERSION || (header.scalarBytes != 4 && header.scalarBytes != 8) || header.count > fits)
+        {
+            cerr << path << ": bad stage header\n";
+            header.count = 0;
+            ok = false;
+            return;
+        }
+        records = data + sizeof header;
+    }
+
+    // reads the next triangle; false at the end of the file
+    bool read(Point p[3])
+    {
+        if (!ok)
+            return false;
+        if (!binary)
+        {
+            text->skipSpace();
+            if (text->pos == text->end)
+                return false;
+            // text records hold x y z only; w must not carry over from the last triangle
+            for (int i = 0; i < 3; i++)
+            {
+                if (!text->point(p[i]))
+                {
+                    cerr << path << ": bad triangle record\n";
+                    ok = false;
+                    return false;
+                }
+                p[i].w = 1;
+            }
+            return true;
+        }
+        if (next >= header.count)
+            return false;
+        double d[9];
+        if (header.scalarBytes == 4)
+        {
+            float f[9];
+            memcpy(f, records + next * sizeof f, sizeof f);
+            copy(f, f + 9, d);
+        }
+        else
+            memcpy(d, records + next * sizeof d, sizeof d);
+        next++;
+        for (int i = 0; i < 3; i++)
+            p[i] = Point(d[3 * i], d[3 * i + 1], d[3 * i + 2]);
+        return true;
+    }
+};
+
+// rewrites a binary stage file in the text layout of stageN.txt; false
+// (after a message) if it is missing, not binary or has a bad header
+bool convertStageFile(const string &inFile, const string &outFile)
+{
+    StageReader reader(inFile);
+    if (!reader.ok)
+        return false;
+    if (!reader.binary)
+    {
+        cerr << inFile << ": not a binary stage file\n";
+        return false;
+    }
+    ofstream out(outFile);
+    Point p[3];
+    while (reader.read(p))
+    {
+        for (int i = 0; i < 3; i++)
+            writeStagePoint(out, p[i]);
+        out << "\n";
+    }
+    return reader.ok;
+}
+
+// ==== Mesh Import ====
+// `mesh <file>` in scene.txt loads an indexed OBJ or PLY mesh: a vertex array
+// and a triangle index array (polygons are split into fans). The stages
+// transform the vertex array once under the current matrix and then build
+// the mesh's triangles from the transformed vertices, so a vertex shared by
+// six triangles is transformed once instead of six times.
+
+struct Mesh
+{
+    vector<Point> vertices;
+    vector<array<int, 3>> triangles;
+};
+
+// appends the fan of polygon poly (1-based or negative OBJ indices)
+bool addObjFace(Mesh &mesh, const vector<long long> &poly)
+{
+    long long n = mesh.vertices.size();
+    vector<int> idx;
+    for (long long i : poly)
+    {
+        long long k = i < 0 ? n + i : i - 1;
+        if (k < 0 || k >= n)
+            return false;
+        idx.push_back((int)k);
+    }
+    for (size_t i = 1; i + 1 < idx.size(); i++)
+        mesh.triangles.push_back({idx[0], idx[i], idx[i + 1]});
+    return true;
+}
+
+bool loadObj(const MappedFile &file, Mesh &mesh)
+{
+    const char *pos = file.data, *end = file.data + file.size;
+    vector<long long> poly;
+    while (pos < end)
+    {
+        const char *eol = find(pos, end, '\n');
+        SceneScanner line(pos, eol);
+        string_view tag;
+        if (line.word(tag) && tag == "v")
+        {
+            Point p;
+            if (!line.point(p))
+                return false;
+            if (!line.number(p.w))
+                p.w = 1;
+            mesh.vertices.push_back(p);
+        }
+        else if (tag == "f")
+        {
+            // v, v/vt, v//vn or v/vt/vn; only the position index is used
+            poly.clear();
+            string_view item;
+            while (line.word(item))
+            {
+                long long i = 0;
+                const char *s = item.data(), *e = item.data() + item.size();
+                if (s < e && *s == '+')
+                    s++;
+                if (from_chars(s, e, i).ec != errc())
+                    return false;
+                poly.push_back(i);
+            }
+            if (!addObjFace(mesh, poly))
+                return false;
+        }
+        pos = eol + (eol < end);
+    }
+    return true;
+}
+
+// reads one PLY property value in the file's encoding
+struct PlyInput
+{
+    SceneScanner ascii;
+    const char *pos, *end;
+    int format; // 0 ascii, 1 binary little endian, 2 binary big endian
+
+    PlyInput(const char *begin, const char *end, int format) : ascii(begin, end), pos(begin), end(end), format(format) {}
+
+    static int typeSize(const string &t)
+    {
+        if (t == "char" || t == "uchar" || t == "int8" || t == "uint8")
+            return 1;
+        if (t == "short" || t == "ushort" || t == "int16" || t == "uint16")
+            return 2;
+        if (t == "int" || t == "uint" || t == "int32" || t == "uint32" || t == "float" || t == "float32")
+            return 4;
+        if (t == "double" || t == "float64")
+            return 8;
+        return 0;
+    }
+
+    bool read(const string &type, double &v)
+    {
+        if (format == 0)
+            return ascii.number(v);
+        int n = typeSize(type);
+        if (n == 0 || end - pos < n)
+            return false;
+        unsigned char b[8];
+        memcpy(b, pos, n);
+        pos += n;
+        if (format == 2)
+            reverse(b, b + n);
+        // the byte order of the running machine is assumed to be little endian
+        if (type == "char" || type == "int8") v = *(int8_t *)b;
+        else if (type == "uchar" || type == "uint8") v = *(uint8_t *)b;
+        else if (type == "short" || type == "int16") { int16_t x; memcpy(&x, b, 2); v = x; }
+        else if (type == "ushort" || type == "uint16") { uint16_t x; memcpy(&x, b, 2); v = x; }
+        else if (type == "int" || type == "int32") { int32_t x; memcpy(&x, b, 4); v = x; }
+        else if (type == "uint" || type == "uint32") { uint32_t x; memcpy(&x, b, 4); v = x; }
+        else if (type == "float" || type == "float32") { float x; memcpy(&x, b, 4); v = x; }
+        else { double x; memcpy(&x, b, 8); v = x; }
+        return true;
+    }
+};
+
+struct PlyProperty
+{
+    string name, type, countType; // countType is set for list properties
+};
+
+struct PlyElement
+{
+    string name;
+    long long count = 0;
+    vector<PlyProperty> properties;
+};
+
+bool loadPly(const MappedFile &file, Mesh &mesh)
+{
+    const char *pos = file.data, *end = file.data + file.size;
+    vector<PlyElement> elements;
+    int format = -1;
+    bool headerDone = false;
+    while (pos < end && !headerDone)
+    {
+        const char *eol = find(pos, end, '\n');
+        istringstream line(string(pos, eol));
+        pos = eol + (eol < end);
+        string tag;
+        line >> tag;
+        if (tag == "format")
+        {
+            string f;
+            line >> f;
+            format = f == "ascii" ? 0 : f == "binary_little_endian" ? 1 : f == "binary_big_endian" ? 2 : -1;
+        }
+        else if (tag == "element")
+        {
+            elements.emplace_back();
+            line >> elements.back().name >> elements.back().count;
+        }
+        else if (tag == "property" && !elements.empty())
+        {
+            PlyProperty prop;
+            line >> prop.type;
+            if (prop.type == "list")
+                line >> prop.countType >> prop.type;
+            line >> prop.name;
+            elements.back().properties.push_back(prop);
+        }
+        else if (tag == "end_header")
+            headerDone = true;
+    }
+    if (format < 0 || !headerDone)
+        return false;
+
+    PlyInput in(pos, end, format);
+    vector<long long> poly;
+    for (const PlyElement &el : elements)
+        for (long long k = 0; k < el.count; k++)
+        {
+            Point p;
+            poly.clear();
+            for (const PlyProperty &prop : el.properties)
+            {
+                double v;
+                if (prop.countType.empty())
+                {
+                    if (!in.read(prop.type, v))
+                        return false;
+                    if (prop.name == "x") p.x = v;
+                    else if (prop.name == "y") p.y = v;
+                    else if (prop.name == "z") p.z = v;
+                    continue;
+                }
+                double count;
+                if (!in.read(prop.countType, count))
+                    return false;
+                bool indices = prop.name == "vertex_indices" || prop.name == "vertex_index";
+                for (long long i = 0; i < (long long)count; i++)
+                {
+                    if (!in.read(prop.type, v))
+                        return false;
+                    if (indices)
+                        poly.push_back((long long)v + 1); // to 1-based, like OBJ
+                }
+            }
+            if (el.name == "vertex")
+                mesh.vertices.push_back(p);
+            else if (el.name == "face" && !addObjFace(mesh, poly))
+                return false;
+        }
+    return true;
+}
+
+// loads an .obj or .ply mesh; prints the problem and returns false on failure
+bool loadMesh(const string &path, Mesh &mesh)
+{
+    mesh = Mesh();
+    string ext = path.substr(path.find_last_of('.') + 1);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (!ifstream(path))
+    {
+        cerr << path << ": cannot open mesh\n";
+        return false;
+    }
+    MappedFile file(path);
+    bool ok = false;
+    if (ext == "obj")
+        ok = loadObj(file, mesh);
+    else if (ext == "ply")
+        ok = file.size >= 3 && memcmp(file.data, "ply", 3) == 0 && loadPly(file, mesh);
+    else
+        cerr << path << ": unknown mesh format (expected .obj or .ply)\n";
+    if (!ok && (ext == "obj" || ext == "ply"))
+        cerr << path << ": cannot read mesh\n";
+    return ok;
+}
+
+// reads the file name after a mesh command and loads it
+// the mesh path is taken relative to dir, the scene's directory
+bool readMeshCommand(SceneScanner &in, Mesh &mesh, const string &dir = "")
+{
+    string_view name;
+    if (!in.word(name))
+        return false;
+    return loadMesh(inDir(dir, string(name)), mesh);
+}
+
+// ==== Scene Interpreter ====
+// Walks the commands of scene.txt, keeps the matrix stack and hands every
+// triangle and mesh to the stage that runs it, together with the stack top
+// to transform it by.
+//
+// `define <name> ... enddef` records the commands in between instead of
+// running them, already parsed: triangles as points, transformations as
+// their matrices, meshes loaded once. `instance <name>` replays a recorded
+// block under the current stack top, between an implicit push and pop, so a
+// sub-assembly used a thousand times is parsed and stored once. A replay
+// applies the same matrix products in the same order as the literal block
+// would, so an instance renders exactly like a copy of its text.
+//
+// With group culling a first pass over the text finds every push/pop group
+// and its bounding box in the frame it starts in (points are only min/maxed
+// there, boxes of nested groups, meshes and instances are carried up through
+// their transformations by their corners). The second pass asks isVisible
+// for every group and instance and skips a hidden one without parsing or
+// transforming anything inside it.
+
+struct Bounds
+{
+    Point lo = Point(HUGE_VAL, HUGE_VAL, HUGE_VAL), hi = Point(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL);
+
+    bool empty() const { return lo.x > hi.x; }
+
+    void add(const Point &p)
+    {
+        lo = Point(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+        hi = Point(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+    }
+
+    // adds box b after transforming its corners by m
+    void add(const Bounds &b, const Mat4 &m)
+    {
+        if (b.empty())
+            return;
+        for (int i = 0; i < 8; i++)
+        {
+            Point c = multiply(m, Point(i & 1 ? b.hi.x : b.lo.x, i & 2 ? b.hi.y : b.lo.y, i & 4 ? b.hi.z : b.lo.z));
+            c.normalize();
+            add(c);
+        }
+    }
+};
+
+struct Definition;
+
+struct SceneOp
+{
+    enum Kind { TRIANGLE, MATRIX, PUSH, POP, MESH, INSTANCE } kind;
+    Mat4 m;                       // MATRIX
+    Point p[3];                   // TRIANGLE
+    shared_ptr<const Mesh> mesh;  // MESH
+    const Definition *def;        // INSTANCE
+};
+
+struct Definition
+{
+    vector<SceneOp> ops;
+    Bounds box;               // in the frame the instance starts in
+    long long triangles = 0;  // including meshes and nested instances
+    const char *end = nullptr; // text position after enddef
+};
+
+// a push/pop group found by the first pass
+struct GroupInfo
+{
+    Bounds box;
+    long long triangles = 0;
+    const char *end = nullptr; // text position after the matching pop
+    bool cullable = true;      // false if it holds a define, which must still run
+};
+
+// accumulates the box and triangle count of a command sequence in the frame
+// it starts in
+struct BoundsBuilder
+{
+    vector<Mat4> rel = {identityMatrix()}; // frame stack relative to the start
+    Bounds box, raw;                       // raw: points in the current frame
+    long long triangles = 0;
+
+    void flush()
+    {
+        box.add(raw, rel.back());
+        raw = Bounds();
+    }
+
+    void apply(const SceneOp &op)
+    {
+        switch (op.kind)
+        {
+        case SceneOp::TRIANGLE:
+            for (int i = 0; i < 3; i++)
+                raw.add(op.p[i]);
+            triangles++;
+            break;
+        case SceneOp::MATRIX:
+            flush();
+            rel.back() = multiply(rel.back(), op.m);
+            break;
+        case SceneOp::PUSH:
+            flush();
+            rel.push_back(rel.back());
+            break;
+        case SceneOp::POP:
+            flush();
+            if (rel.size() > 1)
+                rel.pop_back();
+            break;
+        case SceneOp::MESH:
+        {
+            Bounds mb;
+            for (const Point &p : op.mesh->vertices)
+                mb.add(p);
+            box.add(mb, rel.back());
+            triangles += op.mesh->triangles.size();
+            break;
+        }
+        case SceneOp::INSTANCE:
+            box.add(op.def->box, rel.back());
+            triangles += op.def->triangles;
+            break;
+        }
+    }
+
+    Bounds finish()
+    {
+        flush();
+        return box;
+    }
+};
+
+const int MAX_INSTANCE_DEPTH = 64;
+
+struct SceneInterpreter
+{
+    stack<Mat4> S;
+    size_t floor = 1;      // pop never takes S below this (the frame of the instance being replayed)
+    long long version = 0; // bumped whenever the stack top changes
+    vector<unique_ptr<Definition>> definitions;
+    unordered_map<string, const Definition *> defs;                // name -> latest definition
+    unordered_map<const char *, const Definition *> defsAt;        // first pass, by position
+    unordered_map<const char *, GroupInfo> groups;                 // first pass, by position after push
+    unordered_map<const char *, shared_ptr<const Mesh>> meshes;    // first pass, by position
+    function<void(Point p[3])> onTriangle; // p in model space, transformed in place
+    function<void(const Mesh &)> onMesh;
+    function<bool(const Bounds &)> isVisible; // box under top(); empty = no culling
+    function<void(long long)> onCulled;       // triangles skipped by a hidden group
+    long long groupsCulled = 0, trianglesCulled = 0;
+    string dir;          // mesh paths are relative to it
+    bool failed = false; // a mesh file could not be loaded
+
+    SceneInterpreter() { S.push(identityMatrix()); }
+
+    const Mat4 &top() const { return S.top(); }
+
+    // parses a transformation command into op; false if cmd is not one
+    static bool parseMatrixCommand(string_view cmd, SceneScanner &in, SceneOp &op)
+    {
+        op.kind = SceneOp::MATRIX;
+        if (cmd == "translate")
+        {
+            double tx = 0, ty = 0, tz = 0;
+            in.number(tx) && in.number(ty) && in.number(tz);
+            op.m = translationMatrix(tx, ty, tz);
+        }
+        else if (cmd == "scale")
+        {
+            double sx = 0, sy = 0, sz = 0;
+            in.number(sx) && in.number(sy) && in.number(sz);
+            op.m = scalingMatrix(sx, sy, sz);
+        }
+        else if (cmd == "rotate")
+        {
+            double angle = 0, ax = 0, ay = 0, az = 0;
+            in.number(angle) && in.number(ax) && in.number(ay) && in.number(az);
+            op.m = rotationMatrix(angle, ax, ay, az);
+        }
+        else if (cmd == "push")
+            op.kind = SceneOp::PUSH;
+        else if (cmd == "pop")
+            op.kind = SceneOp::POP;
+        else
+            return false;
+        return true;
+    }
+
+    // parses one drawing or transformation command into op; false if cmd is
+    // none of them (or names something that cannot be loaded)
+    bool readOp(string_view cmd, SceneScanner &in, SceneOp &op)
+    {
+        if (cmd == "triangle")
+        {
+            op.kind = SceneOp::TRIANGLE;
+            for (int i = 0; i < 3; i++)
+                in.point(op.p[i]);
+            return true;
+        }
+        if (cmd == "mesh")
+        {
+            op.kind = SceneOp::MESH;
+            auto cached = meshes.find(in.pos);
+            if (cached != meshes.end())
+            {
+                string_view name;
+                in.word(name);
+                op.mesh = cached->second;
+                meshes.erase(cached);
+                return true;
+            }
+            const char *at = in.pos;
+            shared_ptr<Mesh> mesh(new Mesh);
+            if (!readMeshCommand(in, *mesh, dir))
+            {
+                failed = true;
+                return false;
+            }
+            op.mesh = mesh;
+            if (isVisible)
+                meshes[at] = mesh;
+            return true;
+        }
+        if (cmd == "instance")
+        {
+            string_view name;
+            if (!in.word(name))
+                return false;
+            auto it = defs.find(string(name));
+            if (it == defs.end())
+            {
+                cerr << "instance of undefined " << name << "\n";
+                return false;
+            }
+            op.kind = SceneOp::INSTANCE;
+            op.def = it->second;
+            return true;
+        }
+        return parseMatrixCommand(cmd, in, op);
+    }
+
+    // records the commands after "define <name>" up to enddef
+    void readDefinition(SceneScanner &in)
+    {
+        const char *at = in.pos;
+        string_view name;
+        if (!in.word(name))
+            return;
+        auto known = defsAt.find(at);
+        if (known != defsAt.end())
+        {
+            defs[string(name)] = known->second;
+            in.pos = known->second->end;
+            return;
+        }
+        definitions.emplace_back(new Definition);
+        Definition &def = *definitions.back();
+        BoundsBuilder bounds;
+        string_view cmd;
+        while (in.word(cmd) && cmd != "enddef")
+        {
+            if (cmd == "define")
+                cerr << "define inside define " << name << "\n";
+            SceneOp op;
+            if (!readOp(cmd, in, op))
+                continue;
+            def.ops.push_back(op);
+            bounds.apply(op);
+        }
+        def.box = bounds.finish();
+        def.triangles = bounds.triangles;
+        def.end = in.pos;
+        defs[string(name)] = &def;
+        defsAt[at] = &def;
+    }
+
+    // first pass for group culling: boxes of all push/pop groups from the
+    // current position on; definitions are recorded here already
+    void prescan(const SceneScanner &from)
+    {
+        SceneScanner in(from.pos, from.end);
+        vector<pair<const char *, BoundsBuilder>> open;
+        string_view cmd;
+        while (in.word(cmd))
+        {
+            if (cmd == "end")
+                break;
+            if (cmd == "define")
+            {
+                for (auto &g : open)
+                    groups[g.first].cullable = false;
+                readDefinition(in);
+                continue;
+            }
+            if (cmd == "push")
+            {
+                open.emplace_back(in.pos, BoundsBuilder());
+                continue;
+            }
+            if (cmd == "pop")
+            {
+                if (open.empty())
+                    continue;
+                GroupInfo &g = groups[open.back().first];
+                g.box = open.back().second.finish();
+                g.triangles = open.back().second.triangles;
+                g.end = in.pos;
+                open.pop_back();
+                if (!open.empty())
+                {
+                    BoundsBuilder &parent = open.back().second;
+                    parent.box.add(g.box, parent.rel.back());
+                    parent.triangles += g.triangles;
+                }
+                continue;
+            }
+            SceneOp op;
+            if (readOp(cmd, in, op) && !open.empty())
+                open.back().second.apply(op);
+        }
+        // the definitions are bound again by name in the second pass
+        defs.clear();
+    }
+
+    void cull(long long triangles)
+    {
+        groupsCulled++;
+        trianglesCulled += triangles;
+        if (onCulled)
+            onCulled(triangles);
+    }
+
+    void execute(const SceneOp &op, int depth)
+    {
+        switch (op.kind)
+        {
+        case SceneOp::TRIANGLE:
+        {
+            Point p[3] = {op.p[0], op.p[1], op.p[2]};
+            onTriangle(p);
+            break;
+        }
+        case SceneOp::MATRIX:
+            S.top() = multiply(S.top(), op.m);
+            version++;
+            break;
+        case SceneOp::PUSH:
+            S.push(S.top());
+            break;
+        case SceneOp::POP:
+            if (S.size() > floor)
+            {
+                S.pop();
+                version++;
+            }
+            break;
+        case SceneOp::MESH:
+            onMesh(*op.mesh);
+            break;
+        case SceneOp::INSTANCE:
+            if (depth >= MAX_INSTANCE_DEPTH)
+            {
+                cerr << "instance nesting deeper than " << MAX_INSTANCE_DEPTH << ", skipped\n";
+                break;
+            }
+            if (isVisible && !isVisible(op.def->box))
+            {
+                cull(op.def->triangles);
+                break;
+            }
+        {
+            // the body may push without popping, so unwind to the depth it started at
+            size_t base = S.size(), outer = floor;
+            S.push(S.top());
+            floor = S.size();
+            for (const SceneOp &inner : op.def->ops)
+                execute(inner, depth + 1);
+            while (S.size() > base)
+                S.pop();
+            floor = outer;
+            version++;
+            break;
+        }
+        }
+    }
+
+    // runs the commands after the scene header up to end (or the end of
+    // file); false if a mesh could not be loaded (the rest is still run)
+    bool run(SceneScanner &in)
+    {
+        if (isVisible)
+            prescan(in);
+        string_view cmd;
+        while (in.word(cmd))
+        {
+            if (cmd == "end")
+                break;
+            if (cmd == "define")
+            {
+                readDefinition(in);
+                continue;
+            }
+            if (cmd == "enddef")
+                continue;
+            if (cmd == "push" && isVisible)
+            {
+                auto g = groups.find(in.pos);
+                if (g != groups.end() && g->second.cullable && !isVisible(g->second.box))
+                {
+                    cull(g->second.triangles);
+                    in.pos = g->second.end;
+                    continue;
+                }
+            }
+            SceneOp op;
+            if (readOp(cmd, in, op))
+                execute(op, 0);
+        }
+        return !failed;
+    }
+};
+
+// ==== Stage 1: Modeling Transformation ====
+// stages 1-4 return false if their input could not be read
+bool stage1(const RenderOptions &opts)
+{
+    SceneScanner in(inDir(opts.dir, "scene.txt"));
+    StageWriter out(1, opts.stageFormat, opts.dir);
+    SceneInterpreter scene;
+    scene.dir = opts.dir;
+    scene.onTriangle = [&](Point p[3])
+    {
+        transformPoints(scene.top(), p, p, 3);
+        for (int i = 0; i < 3; i++)
+            p[i].normalize();
+        out.write(p);
+    };
+    scene.onMesh = [&](const Mesh &mesh)
+    {
+        vector<Point> v = mesh.vertices;
+        transformPoints(scene.top(), v.data(), v.data(), v.size());
+        for (Point &p : v)
+            p.normalize();
+        for (auto &t : mesh.triangles)
+        {
+            Point p[3] = {v[t[0]], v[t[1]], v[t[2]]};
+            out.write(p);
+        }
+    };
+    bool ok = scene.run(in);
+    out.close();
+    return ok;
+}
+
+// ==== Stage 2: View Transformation ====
+bool stage2(const RenderOptions &opts)
+{
+    SceneScanner config(inDir(opts.dir, "scene.txt"));
+    StageReader in(1, opts.stageFormat, opts.dir);
+    StageWriter out(2, opts.stageFormat, opts.dir);
+
+    Camera cam = readCamera(config);
+    Mat4 V = viewMatrix(cam);
+
+    Point p[3];
+    while (in.read(p))
+    {
+        transformPoints(V, p, p, 3);
+        for (int i = 0; i < 3; i++)
+            p[i].normalize();
+        out.write(p);
+    }
+
+    out.close();
+    return in.ok;
+}
+
+// ==== Clipping ====
+// Runs on projected points before the divide by w. A vertex is inside the
+// view volume when -w <= x, y, z <= w; one outcode bit per violated plane.
+// Triangles with all outcodes zero are accepted as they are, triangles with
+// all three vertices outside the same plane are dropped, and the rest are cut
+// plane by plane (Sutherland-Hodgman) and fanned back into triangles.
+
+struct ClipStats
+{
+    long long in = 0, accepted = 0, culled = 0, clipped = 0, produced = 0;
+};
+
+// signed distance to clip plane i (inside >= 0)
+double planeDistance(const Point &p, int i)
+{
+    switch (i)
+    {
+    case 0: return p.w + p.x;
+    case 1: return p.w - p.x;
+    case 2: return p.w + p.y;
+    case 3: return p.w - p.y;
+    case 4: return p.w + p.z;
+    default: return p.w - p.z;
+    }
+}
+
+int outcode(const Point &p)
+{
+    int code = 0;
+    for (int i = 0; i < 6; i++)
+        if (planeDistance(p, i) < 0)
+            code |= 1 << i;
+    return code;
+}
+
+// clips the projected triangle p, divides by w and writes the resulting
+// triangles to out (room for 7); returns how many were written
+int clipTriangle(const Point p[3], Point out[][3], ClipStats &stats)
+{
+    stats.in++;
+    int c0 = outcode(p[0]), c1 = outcode(p[1]), c2 = outcode(p[2]);
+    if (c0 & c1 & c2)
+    {
+        stats.culled++;
+        return 0;
+    }
+    if (!(c0 | c1 | c2))
+    {
+        stats.accepted++;
+        stats.produced++;
+        for (int i = 0; i < 3; i++)
+        {
+            out[0][i] = p[i];
+            out[0][i].normalize();
+        }
+        return 1;
+    }
+
+    Point poly[9], next[9];
+    int n = 3;
+    copy(p, p + 3, poly);
+    for (int plane = 0; plane < 6 && n > 0; plane++)
+    {
+        if (!((c0 | c1 | c2) & (1 << plane)))
+            continue;
+        int m = 0;
+        for (int i = 0; i < n; i++)
+        {
+            const Point &a = poly[i], &b = poly[(i + 1) % n];
+            double da = planeDistance(a, plane), db = planeDistance(b, plane);
+            if (da >= 0)
+                next[m++] = a;
+            if ((da >= 0) != (db >= 0))
+            {
+                double t = da / (da - db);
+                next[m++] = Point(a.x + t * (b.x - a.x), a.y + t * (b.y - a.y),
+                                  a.z + t * (b.z - a.z), a.w + t * (b.w - a.w));
+            }
+        }
+        n = m;
+        copy(next, next + n, poly);
+    }
+    if (n < 3)
+    {
+        stats.culled++;
+        return 0;
+    }
+
+    stats.clipped++;
+    for (int i = 0; i < n; i++)
+        poly[i].normalize();
+    for (int i = 1; i + 1 < n; i++)
+    {
+        out[i - 1][0] = poly[0];
+        out[i - 1][1] = poly[i];
+        out[i - 1][2] = poly[i + 1];
+    }
+    stats.produced += n - 2;
+    return n - 2;
+}
+
+void printClipStats(const ClipStats &stats)
+{
+    cout << "clip: " << stats.in << " in, " << stats.accepted << " accepted, "
+         << stats.culled << " culled, " << stats.clipped << " clipped, "
+         << stats.produced << " out" << endl;
+}
+
+// ==== Stage 3: Projection Transformation ====
+bool stage3(const RenderOptions &opts)
+{
+    SceneScanner config(inDir(opts.dir, "scene.txt"));
+    StageReader in(2, opts.stageFormat, opts.dir);
+    StageWriter out(3, opts.stageFormat, opts.dir);
+
+    Camera cam = readCamera(config);
+    Mat4 P = projectionMatrix(cam);
+
+    ClipStats stats;
+    Point p[3];
+    while (in.read(p))
+    {
+        transformPoints(P, p, p, 3);
+        if (opts.clip)
+        {
+            Point pieces[7][3];
+            int count = clipTriangle(p, pieces, stats);
+            for (int k = 0; k < count; k++)
+                out.write(pieces[k]);
+            continue;
+        }
+        for (int i = 0; i < 3; i++)
+            p[i].normalize();
+        out.write(p);
+    }
+    if (opts.clip)
+        printClipStats(stats);
+
+    out.close();
+    return in.ok;
+}
+
+// ==== Stage 4: Z-Buffer and Scan Conversion ====
+
+// inclusive pixel range a triangle may touch
+struct Rect
+{
+    int row0, row1, col0, col1;
+};
+
+// pixel rows/cols the scanline loop can reach for tri; the columns are
+// padded by one because the edge intersections may round past the vertices
+Rect triangleBounds(const Triangle &tri, const ScreenConfig &sc)
+{
+    double minX = min({tri.points[0].x, tri.points[1].x, tri.points[2].x});
+    double maxX = max({tri.points[0].x, tri.points[1].x, tri.points[2].x});
+    double minY = min({tri.points[0].y, tri.points[1].y, tri.points[2].y});
+    double maxY = max({tri.points[0].y, tri.points[1].y, tri.points[2].y});
+    Rect r;
+    r.row0 = max(0, (int)ceil((sc.topY - maxY) / sc.dy));
+    r.row1 = min(sc.height - 1, (int)floor((sc.topY - minY) / sc.dy));
+    r.col0 = max(0, (int)ceil((minX - sc.leftX) / sc.dx) - 1);
+    r.col1 = min(sc.width - 1, (int)floor((maxX - sc.leftX) / sc.dx) + 1);
+    return r;
+}
+
+// ==== Raster Counters ====
+// Filled only by the counting instantiations of the raster cores
+// (STATS = true), so a run without --stats or --heatmap pays nothing in the
+// pixel loops. With --threads every tile counts into its own copy.
+
+struct RasterStats
+{
+    long long calls = 0;           // raster core calls (triangle x tile with --threads)
+    long long culled = 0;          // calls that tested no pixel at all
+    long long scanlines = 0;       // pixel rows walked
+    long long pixelsTested = 0;    // pixels whose coverage or depth was evaluated
+    long long depthPasses = 0;     // pixels that passed the depth test
+    long long pixelWrites = 0;     // color and depth writes
+    long long hizBlocksCulled = 0; // 8x8 blocks skipped by hierarchical z
+    long long prepassColorWrites = 0; // --prepass: color writes of the second pass
+
+    void add(const RasterStats &o)
+    {
+        calls += o.calls;
+        culled += o.culled;
+        scanlines += o.scanlines;
+        pixelsTested += o.pixelsTested;
+        depthPasses += o.depthPasses;
+        pixelWrites += o.pixelWrites;
+        hizBlocksCulled += o.hizBlocksCulled;
+        prepassColorWrites += o.prepassColorWrites;
+    }
+};
+
+// ==== Hierarchical Z ====
+// Coarse depth bounds kept next to the z-buffer: for every 8x8 pixel block a
+// lower (zmin) and upper (zmax) bound of the depths stored in it, and on top a
+// level holding the largest zmax of each group of blocks. Depth writes only
+// lower stored values, so zmax stays a valid bound after a write; written
+// blocks are just marked dirty and their zmax is recomputed lazily, when the
+// looser bound fails to reject something. A triangle, or one 8x8 block of it,
+// whose nearest depth is not in front of zmax cannot pass a single depth test
+// and is skipped without touching its pixels.
+
+const int BLOCK = 8;
+const double HIZ_EPS = 1e-9; // slack for rounding in interpolated depths
+
+struct HiZ
+{
+    bool enabled = false;
+    int blocksX = 0, blocksY = 0;
+    int groupBlocks = 8; // group edge in blocks
+    int groupsX = 0, groupsY = 0;
+    vector<double> zmin, zmax;
+    vector<char> dirty;
+    vector<double> groupMax;
+    vector<char> groupDirty;
+};
+
+// ==== Depth Buffer ====
+// The z-buffer is one 64-byte aligned block, rows padded to whole cache
+// lines, holding each depth as a double (default), a float32 or a 24-bit
+// unorm of the z_front..z_rear range in the low bits of a 32-bit word. The
+// raster cores compare stored values, so a compact format also tests depth
+// at its own precision:
+//   double   8 bytes, the exact interpolated depth
+//   float32  4 bytes, 24-bit mantissa: steps of 6e-8 near 1, finer near 0
+//   unorm24  4 bytes, 2^24 even steps over the range (1.2e-7 for -1..1)
+// Triangles closer together than a step z-fight: the earlier one keeps the
+// pixel. Only the double format uses the SIMD span kernel and the hi-z
+// blind-write path.
+
+enum DepthFormat
+{
+    DEPTH_DOUBLE,
+    DEPTH_FLOAT32,
+    DEPTH_UNORM24
+};
+
+const uint32_t UNORM24_MAX = (1u << 24) - 1;
+
+DepthFormat depthFormatOf(const string &name)
+{
+    return name == "float32" ? DEPTH_FLOAT32 : name == "unorm24" ? DEPTH_UNORM24 : DEPTH_DOUBLE;
+}
+
+size_t depthBytes(DepthFormat format)
+{
+    return format == DEPTH_DOUBLE ? sizeof(double) : sizeof(uint32_t);
+}
+
+// encode/decode of one format; the cleared value decodes to z_rear exactly
+struct DoubleDepth
+{
+    typedef double Value;
+    explicit DoubleDepth(const ScreenConfig &) {}
+    Value encode(double z) const { return z; }
+    double decode(Value v) const { return v; }
+};
+
+struct FloatDepth
+{
+    typedef float Value;
+    double zRear;
+    explicit FloatDepth(const ScreenConfig &sc) : zRear(sc.z_rear) {}
+    Value encode(double z) const { return (float)z; }
+    double decode(Value v) const { return v == (float)zRear ? zRear : v; }
+};
+
+// z must not be NaN; the cores test z >= z_front first
+struct Unorm24Depth
+{
+    typedef uint32_t Value;
+    double zFront, zRear, scale;
+    explicit Unorm24Depth(const ScreenConfig &sc)
+        : zFront(sc.z_front), zRear(sc.z_rear), scale(UNORM24_MAX / (sc.z_rear - sc.z_front)) {}
+    Value encode(double z) const
+    {
+        double u = (z - zFront) * scale + 0.5;
+        return u <= 0 ? 0 : u >= UNORM24_MAX ? UNORM24_MAX : (Value)u;
+    }
+    double decode(Value v) const { return v == UNORM24_MAX ? zRear : zFront + v / scale; }
+};
+
+struct DepthBuffer
+{
+    DepthFormat format = DEPTH_DOUBLE;
+    int width = 0, rows = 0;
+    int firstRow = 0;        // screen row of buffer row 0 (bands hold only their rows)
+    size_t rowBytes = 0, capacity = 0;
+    unique_ptr<unsigned char[], void (*)(void *)> data{nullptr, free};
+    ScreenConfig sc{};
+
+    // count rows from screen row first, all at z_rear; the block is kept
+    // when it is large enough
+    void reset(const ScreenConfig &config, DepthFormat f, int first, int count)
+    {
+        sc = config;
+        format = f;
+        width = sc.width;
+        rows = count;
+        firstRow = first;
+        rowBytes = (width * depthBytes(format) + 63) / 64 * 64;
+        size_t bytes = max<size_t>(64, rowBytes * rows);
+        if (bytes > capacity)
+        {
+            data.reset((unsigned char *)aligned_alloc(64, bytes));
+            if (!data)
+                throw bad_alloc();
+            capacity = bytes;
+        }
+        if (format == DEPTH_DOUBLE)
+            fillRows<DoubleDepth>();
+        else if (format == DEPTH_FLOAT32)
+            fillRows<FloatDepth>();
+        else
+            fillRows<Unorm24Depth>();
+    }
+
+    template <class Depth>
+    void fillRows()
+    {
+        typename Depth::Value clear = Depth(sc).encode(sc.z_rear);
+        for (int r = 0; r < rows; r++)
+            fill_n((typename Depth::Value *)(data.get() + r * rowBytes), width, clear);
+    }
+
+    template <class T>
+    T *row(int screenRow) const
+    {
+        return (T *)(data.get() + (size_t)(screenRow - firstRow) * rowBytes);
+    }
+
+    double get(int screenRow, int col) const
+    {
+        if (format == DEPTH_DOUBLE)
+            return row<double>(screenRow)[col];
+        if (format == DEPTH_FLOAT32)
+            return FloatDepth(sc).decode(row<float>(screenRow)[col]);
+        return Unorm24Depth(sc).decode(row<uint32_t>(screenRow)[col]);
+    }
+
+    void set(int screenRow, int col, double z)
+    {
+        if (format == DEPTH_DOUBLE)
+            row<double>(screenRow)[col] = z;
+        else if (format == DEPTH_FLOAT32)
+            row<float>(screenRow)[col] = FloatDepth(sc).encode(z);
+        else
+            row<uint32_t>(screenRow)[col] = Unorm24Depth(sc).encode(z);
+    }
+
+    // one row as doubles: the row itself, or decoded into scratch
+    const double *depths(int screenRow, vector<double> &scratch) const
+    {
+        if (format == DEPTH_DOUBLE)
+            return row<double>(screenRow);
+        scratch.resize(width);
+        for (int c = 0; c < width; c++)
+            scratch[c] = get(screenRow, c);
+        return scratch.data();
+    }
+};
+
+struct RenderTarget
+{
+    DepthBuffer zBuffer;
+    bitmap_image image;
+    HiZ hiz;
+    vector<uint32_t> overdraw; // writes per pixel, row major; empty unless --heatmap
+    int rowOffset = 0;           // screen row of image row 0 (and of the sample arrays), for bands
+    int samples = 1;             // > 1: multisampled, zBuffer is only filled by the resolve
+    vector<float> sampleZ;       // row major pixels, their samples next to each other
+    vector<uint32_t> sampleColor; // 0xRRGGBB per sample
+    unique_ptr<atomic<uint64_t>[]> depthWords; // triangle-parallel: depth key and triangle id per pixel
+    size_t depthWordCount = 0;
+    vector<uint8_t> pending;     // --prepass: pixels whose depth the first pass set, row major like the image
+};
+
+template <bool STATS>
+inline void countWrite(RenderTarget &target, RasterStats &stats, int row, int col)
+{
+    if (!STATS)
+        return;
+    stats.depthPasses++;
+    stats.pixelWrites++;
+    if (!target.overdraw.empty())
+        target.overdraw[(size_t)(row - target.rowOffset) * target.image.width() + col]++;
+}
+
+void initHiZ(HiZ &hiz, const ScreenConfig &sc, int groupPixels)
+{
+    hiz.enabled = true;
+    hiz.blocksX = (sc.width + BLOCK - 1) / BLOCK;
+    hiz.blocksY = (sc.height + BLOCK - 1) / BLOCK;
+    hiz.groupBlocks = max(1, groupPixels / BLOCK);
+    hiz.groupsX = (hiz.blocksX + hiz.groupBlocks - 1) / hiz.groupBlocks;
+    hiz.groupsY = (hiz.blocksY + hiz.groupBlocks - 1) / hiz.groupBlocks;
+    hiz.zmin.assign(hiz.blocksX * hiz.blocksY, sc.z_rear);
+    hiz.zmax.assign(hiz.blocksX * hiz.blocksY, sc.z_rear);
+    hiz.dirty.assign(hiz.blocksX * hiz.blocksY, 0);
+    hiz.groupMax.assign(hiz.groupsX * hiz.groupsY, sc.z_rear);
+    hiz.groupDirty.assign(hiz.groupsX * hiz.groupsY, 0);
+}
+
+// records that depths down to zLow were written into block (bx, by)
+void hizMarkWritten(HiZ &hiz, int bx, int by, double zLow)
+{
+    int b = by * hiz.blocksX + bx;
+    hiz.zmin[b] = min(hiz.zmin[b], zLow);
+    hiz.dirty[b] = 1;
+}
+
+// sets the exact zmax of a block that was just overwritten completely
+void hizSetBlock(HiZ &hiz, int bx, int by, double zLow, double zHigh)
+{
+    int b = by * hiz.blocksX + bx;
+    hiz.zmin[b] = min(hiz.zmin[b], zLow);
+    hiz.zmax[b] = zHigh;
+    hiz.dirty[b] = 0;
+    hiz.groupDirty[(by / hiz.groupBlocks) * hiz.groupsX + bx / hiz.groupBlocks] = 1;
+}
+
+double hizBlockMax(RenderTarget &target, int bx, int by)
+{
+    HiZ &hiz = target.hiz;
+    int b = by * hiz.blocksX + bx;
+    if (hiz.dirty[b])
+    {
+        const DepthBuffer &zBuffer = target.zBuffer;
+        double m = -numeric_limits<double>::infinity();
+        for (int r = by * BLOCK; r < min(zBuffer.rows, (by + 1) * BLOCK); r++)
+            for (int c = bx * BLOCK; c < min(zBuffer.width, (bx + 1) * BLOCK); c++)
+                m = max(m, zBuffer.get(r, c));
+        hiz.zmax[b] = m;
+        hiz.dirty[b] = 0;
+        hiz.groupDirty[(by / hiz.groupBlocks) * hiz.groupsX + bx / hiz.groupBlocks] = 1;
+    }
+    return hiz.zmax[b];
+}
+
+double hizGroupMax(HiZ &hiz, int gx, int gy)
+{
+    int g = gy * hiz.groupsX + gx;
+    if (hiz.groupDirty[g])
+    {
+        double m = -numeric_limits<double>::infinity();
+        for (int by = gy * hiz.groupBlocks; by < min(hiz.blocksY, (gy + 1) * hiz.groupBlocks); by++)
+            for (int bx = gx * hiz.groupBlocks; bx < min(hiz.blocksX, (gx + 1) * hiz.groupBlocks); bx++)
+                m = max(m, hiz.zmax[by * hiz.blocksX + bx]);
+        hiz.groupMax[g] = m;
+        hiz.groupDirty[g] = 0;
+    }
+    return hiz.groupMax[g];
+}
+
+// true if no depth >= zNear can pass the depth test in block (bx, by)
+bool hizBlockHidden(RenderTarget &target, int bx, int by, double zNear)
+{
+    HiZ &hiz = target.hiz;
+    int b = by * hiz.blocksX + bx;
+    if (zNear - HIZ_EPS >= hiz.zmax[b])
+        return true;
+    return hiz.dirty[b] && zNear - HIZ_EPS >= hizBlockMax(target, bx, by);
+}
+
+// true if no depth >= zNear can pass the depth test anywhere in r; groups
+// are tried first, then the blocks of the groups that were not hidden
+bool hizRectHidden(RenderTarget &target, const Rect &r, double zNear)
+{
+    HiZ &hiz = target.hiz;
+    int groupPixels = hiz.groupBlocks * BLOCK;
+    for (int gy = r.row0 / groupPixels; gy <= r.row1 / groupPixels; gy++)
+        for (int gx = r.col0 / groupPixels; gx <= r.col1 / groupPixels; gx++)
+        {
+            if (zNear - HIZ_EPS >= hizGroupMax(hiz, gx, gy))
+                continue;
+            int by0 = max(r.row0, gy * groupPixels) / BLOCK, by1 = min(r.row1, (gy + 1) * groupPixels - 1) / BLOCK;
+            int bx0 = max(r.col0, gx * groupPixels) / BLOCK, bx1 = min(r.col1, (gx + 1) * groupPixels - 1) / BLOCK;
+            for (int by = by0; by <= by1; by++)
+                for (int bx = bx0; bx <= bx1; bx++)
+                    if (!hizBlockHidden(target, bx, by, zNear))
+                        return false;
+        }
+    return true;
+}
+
+// ==== Depth Prepass ====
+// With --prepass every batch goes through the raster core twice. The first
+// pass only tests and writes depth; the second writes color where the
+// triangle's depth equals the stored one, so each visible pixel is colored
+// once however deep the overdraw is, which is where per-pixel shading
+// (anything past tri.color) would be done. The first pass flags the pixels
+// whose depth it set, and the second colors a flagged pixel only once and
+// clears the flag. The first triangle in order with the nearest depth
+// therefore colors it, as in the single pass: the output is unchanged. The
+// depth is computed by the same code in both passes, so the equality test
+// is exact.
+
+const int PASS_SINGLE = 0; // depth test, depth and color writes
+const int PASS_DEPTH = 1;  // depth test and depth write, pixel flagged
+const int PASS_COLOR = 2;  // color write of flagged pixels at the stored depth
+
+// the target's rows as the single-sample cores write them
+template <class Depth>
+struct PixelRow
+{
+    typename Depth::Value *z;
+    uint8_t *pending;
+    unsigned char *pixels;
+};
+
+template <class Depth>
+inline PixelRow<Depth> pixelRow(RenderTarget &target, int row)
+{
+    size_t image = (size_t)(row - target.rowOffset) * target.image.width();
+    return {target.zBuffer.row<typename Depth::Value>(row), target.pending.empty() ? nullptr : &target.pending[image],
+            target.image.row(row - target.rowOffset)};
+}
+
+inline void writeColor(const RenderTarget &target, unsigned char *pixels, int col, const Color &color)
+{
+    unsigned char *p = pixels + col * target.image.bytes_per_pixel();
+    p[0] = color.b;
+    p[1] = color.g;
+    p[2] = color.r;
+}
+
+// one pixel at depth z; true if it was written (only its depth in the
+// first prepass pass, only its color in the second)
+template <class Depth, bool STATS, int PASS>
+inline bool shadePixel(const Depth &depth, const PixelRow<Depth> &pr, int row, int col, double z, const Color &color,
+                       const ScreenConfig &sc, RenderTarget &target, RasterStats &stats)
+{
+    if (!(z >= sc.z_front))
+        return false;
+    typename Depth::Value v = depth.encode(z);
+    if (PASS == PASS_COLOR)
+    {
+        if (!pr.pending[col] || v != pr.z[col])
+            return false;
+        pr.pending[col] = 0;
+        writeColor(target, pr.pixels, col, color);
+        if (STATS)
+            stats.prepassColorWrites++;
+        return true;
+    }
+    if (!(v < pr.z[col]))
+        return false;
+    pr.z[col] = v;
+    if (PASS == PASS_DEPTH)
+        pr.pending[col] = 1;
+    else
+        writeColor(target, pr.pixels, col, color);
+    countWrite<STATS>(target, stats, row, col);
+    return true;
+}
+
+// ==== Span Kernel ====
+// The scanline core's innermost loop: depth test and write of pixels
+// leftCol..rightCol of one row, with
+//   z = zl + (leftX + col * dx - xl) * (zr - zl) / (xr - xl)
+// evaluated in this order for every pixel, so the vector paths (four pixels
+// at a time with AVX, two with SSE2) produce the same depths as the scalar
+// loop. Passing depths are stored with a masked store on the z-buffer row
+// and their colors go straight into the bitmap row. Add -mavx2 to the
+// compile line for the AVX path, as for the matrix kernels. The compact
+// depth formats and the prepass passes take the scalar loop.
+
+template <bool STATS>
+inline void writeSpanPixel(RenderTarget &target, RasterStats &stats, unsigned char *pixels, int row, int col,
+                           const Color &color)
+{
+    writeColor(target, pixels, col, color);
+    countWrite<STATS>(target, stats, row, col);
+}
+
+// true if any pixel was written
+template <class Depth, bool STATS, int PASS>
+bool shadeSpan(int row, int leftCol, int rightCol, double xl, double xr, double zl, double zr, const Color &color,
+               const ScreenConfig &sc, RenderTarget &target, RasterStats &stats)
+{
+    Depth depth(sc);
+    PixelRow<Depth> pr = pixelRow<Depth>(target, row);
+    double dzNum = zr - zl, dxDen = xr - xl;
+    bool wrote = false;
+    int col = leftCol;
+    if constexpr (is_same<Depth, DoubleDepth>::value && PASS == PASS_SINGLE)
+    {
+        double *zRow = pr.z;
+        unsigned char *pixels = pr.pixels;
+#if defined(__AVX__)
+        __m256d leftX = _mm256_set1_pd(sc.leftX), dx = _mm256_set1_pd(sc.dx), front = _mm256_set1_pd(sc.z_front);
+        __m256d vxl = _mm256_set1_pd(xl), vzl = _mm256_set1_pd(zl);
+        __m256d num = _mm256_set1_pd(dzNum), den = _mm256_set1_pd(dxDen);
+        __m256d cols = _mm256_set_pd(col + 3, col + 2, col + 1, col), four = _mm256_set1_pd(4);
+        for (; col + 3 <= rightCol; col += 4, cols = _mm256_add_pd(cols, four))
+        {
+            __m256d scanX = _mm256_add_pd(leftX, _mm256_mul_pd(cols, dx));
+            __m256d z = _mm256_add_pd(vzl, _mm256_div_pd(_mm256_mul_pd(_mm256_sub_pd(scanX, vxl), num), den));
+            __m256d pass = _mm256_and_pd(_mm256_cmp_pd(z, front, _CMP_GE_OQ),
+                                         _mm256_cmp_pd(z, _mm256_loadu_pd(zRow + col), _CMP_LT_OQ));
+            int mask = _mm256_movemask_pd(pass);
+            if (!mask)
+                continue;
+            _mm256_maskstore_pd(zRow + col, _mm256_castpd_si256(pass), z);
+            for (; mask; mask &= mask - 1)
+                writeSpanPixel<STATS>(target, stats, pixels, row, col + __builtin_ctz(mask), color);
+            wrote = true;
+        }
+#elif defined(__SSE2__)
+        __m128d leftX = _mm_set1_pd(sc.leftX), dx = _mm_set1_pd(sc.dx), front = _mm_set1_pd(sc.z_front);
+        __m128d vxl = _mm_set1_pd(xl), vzl = _mm_set1_pd(zl);
+        __m128d num = _mm_set1_pd(dzNum), den = _mm_set1_pd(dxDen);
+        __m128d cols = _mm_set_pd(col + 1, col), two = _mm_set1_pd(2);
+        for (; col + 1 <= rightCol; col += 2, cols = _mm_add_pd(cols, two))
+        {
+            __m128d scanX = _mm_add_pd(leftX, _mm_mul_pd(cols, dx));
+            __m128d z = _mm_add_pd(vzl, _mm_div_pd(_mm_mul_pd(_mm_sub_pd(scanX, vxl), num), den));
+            __m128d old = _mm_loadu_pd(zRow + col);
+            __m128d pass = _mm_and_pd(_mm_cmpge_pd(z, front), _mm_cmplt_pd(z, old));
+            int mask = _mm_movemask_pd(pass);
+            if (!mask)
+                continue;
+            _mm_storeu_pd(zRow + col, _mm_or_pd(_mm_and_pd(pass, z), _mm_andnot_pd(pass, old)));
+            for (; mask; mask &= mask - 1)
+                writeSpanPixel<STATS>(target, stats, pixels, row, col + __builtin_ctz(mask), color);
+            wrote = true;
+        }
+#endif
+    }
+    for (; col <= rightCol; col++)
+    {
+        double scanX = sc.leftX + col * sc.dx;
+        double z = zl + (scanX - xl) * dzNum / dxDen;
+        if (shadePixel<Depth, STATS, PASS>(depth, pr, row, col, z, color, sc, target, stats))
+            wrote = true;
+    }
+    return wrote;
+}
+
+// scan converts one triangle, touching only the pixels inside clip
+template <class Depth, bool STATS, int PASS>
+void rasterizeScanline(const Triangle &tri, const ScreenConfig &sc, const Rect &clip, RenderTarget &target, RasterStats &stats)
+{
+    double minY = min({tri.points[0].y, tri.points[1].y, tri.points[2].y});
+    double maxY = max({tri.points[0].y, tri.points[1].y, tri.points[2].y});
+
+    int topScan = max(clip.row0, (int)ceil((sc.topY - maxY) / sc.dy));
+    int bottomScan = min(clip.row1, (int)floor((sc.topY - minY) / sc.dy));
+
+    Rect bounds;
+    double zNear = min({tri.points[0].z, tri.points[1].z, tri.points[2].z});
+    if (target.hiz.enabled)
+    {
+        bounds = triangleBounds(tri, sc);
+        bounds.row0 = max(bounds.row0, clip.row0);
+        bounds.row1 = min(bounds.row1, clip.row1);
+        bounds.col0 = max(bounds.col0, clip.col0);
+        bounds.col1 = min(bounds.col1, clip.col1);
+        if (bounds.row0 > bounds.row1 || bounds.col0 > bounds.col1 || hizRectHidden(target, bounds, zNear))
+            return;
+    }
+
+    bool wrote = false;
+    for (int row = topScan; row <= bottomScan; row++)
+    {
+        double scanY = sc.topY - row * sc.dy;
+        if (STATS)
+            stats.scanlines++;
+
+        double xints[3], zvals[3];
+        int count = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            const Point &p1 = tri.points[i];
+            const Point &p2 = tri.points[(i + 1) % 3];
+            if ((p1.y <= scanY && p2.y >= scanY) || (p2.y <= scanY && p1.y >= scanY))
+            {
+                if (p1.y != p2.y)
+                {
+                    xints[count] = p1.x + (scanY - p1.y) * (p2.x - p1.x) / (p2.y - p1.y);
+                    zvals[count] = p1.z + (scanY - p1.y) * (p2.z - p1.z) / (p2.y - p1.y);
+                    count++;
+                }
+            }
+        }
+
+        if (count < 2)
+            continue;
+        double xl = min(xints[0], xints[1]);
+        double xr = max(xints[0], xints[1]);
+        double zl = xints[0] < xints[1] ? zvals[0] : zvals[1];
+        double zr = xints[0] < xints[1] ? zvals[1] : zvals[0];
+
+        int leftCol = max(clip.col0, (int)ceil((xl - sc.leftX) / sc.dx));
+        int rightCol = min(clip.col1, (int)floor((xr - sc.leftX) / sc.dx));
+        if (STATS)
+            stats.pixelsTested += max(0, rightCol - leftCol + 1);
+
+        if (leftCol <= rightCol && shadeSpan<Depth, STATS, PASS>(row, leftCol, rightCol, xl, xr, zl, zr, tri.color, sc, target, stats))
+            wrote = true;
+    }
+
+    // the scanline loop does not track which blocks it wrote, so every block
+    // of the bounds is marked
+    if (target.hiz.enabled && wrote && PASS != PASS_COLOR)
+        for (int by = bounds.row0 / BLOCK; by <= bounds.row1 / BLOCK; by++)
+            for (int bx = bounds.col0 / BLOCK; bx <= bounds.col1 / BLOCK; bx++)
+                hizMarkWritten(target.hiz, bx, by, zNear - HIZ_EPS);
+}
+
+// ==== Half-Space Scan Conversion ====
+// Works in pixel space, where pixel (col, row) has its center at integer
+// coordinates. Each edge becomes E(col, row) = A * col + B * row + C, positive
+// inside, and depth becomes the plane z = zA * col + zB * row + zC, all set up
+// once per triangle. The bounding box is walked in 8x8 screen-aligned blocks:
+// a block with all four corners outside one edge is skipped, a block with all
+// corners inside every edge skips the per-pixel edge tests, and stepping one
+// pixel is a few adds. Pixels on an edge count as inside, like the scanline
+// core's ceil/floor span ends.
+//
+// With hierarchical z each block is also tested against the block's stored
+// zmax, and a fully covered block that lies entirely in front of its zmin is
+// written without reading the z-buffer.
+
+template <class Depth, bool STATS, int PASS>
+void rasterizeHalfSpace(const Triangle &tri, const ScreenConfig &sc, const Rect &clip, RenderTarget &target, RasterStats &stats)
+{
+    double u[3], v[3], z[3];
+    for (int i = 0; i < 3; i++)
+    {
+        u[i] = (tri.points[i].x - sc.leftX) / sc.dx;
+        v[i] = (sc.topY - tri.points[i].y) / sc.dy;
+        z[i] = tri.points[i].z;
+        if (!isfinite(u[i]) || !isfinite(v[i]))
+            return;
+    }
+    double area = (u[1] - u[0]) * (v[2] - v[0]) - (v[1] - v[0]) * (u[2] - u[0]);
+    if (area == 0)
+        return;
+    double sign = area > 0 ? 1 : -1;
+
+    double A[3], B[3], C[3];
+    for (int i = 0; i < 3; i++)
+    {
+        int j = (i + 1) % 3;
+        A[i] = -(v[j] - v[i]) * sign;
+        B[i] = (u[j] - u[i]) * sign;
+        C[i] = -(A[i] * u[i] + B[i] * v[i]);
+    }
+    double zA = ((z[1] - z[0]) * (v[2] - v[0]) - (z[2] - z[0]) * (v[1] - v[0])) / area;
+    double zB = ((z[2] - z[0]) * (u[1] - u[0]) - (z[1] - z[0]) * (u[2] - u[0])) / area;
+    double zC = z[0] - zA * u[0] - zB * v[0];
+
+    int col0 = (int)clamp(ceil(min({u[0], u[1], u[2]})), (double)clip.col0, clip.col1 + 1.0);
+    int col1 = (int)clamp(floor(max({u[0], u[1], u[2]})), clip.col0 - 1.0, (double)clip.col1);
+    int row0 = (int)clamp(ceil(min({v[0], v[1], v[2]})), (double)clip.row0, clip.row1 + 1.0);
+    int row1 = (int)clamp(floor(max({v[0], v[1], v[2]})), clip.row0 - 1.0, (double)clip.row1);
+    if (col0 > col1 || row0 > row1)
+        return;
+
+    HiZ &hiz = target.hiz;
+    double triNear = min({z[0], z[1], z[2]}), triFar = max({z[0], z[1], z[2]});
+    if (hiz.enabled && hizRectHidden(target, {row0, row1, col0, col1}, triNear))
+        return;
+    if (STATS)
+        stats.scanlines += row1 - row0 + 1;
+
+    Depth depth(sc);
+    for (int by = row0 - row0 % BLOCK; by <= row1; by += BLOCK)
+    {
+        int r0 = max(by, row0), r1 = min(by + BLOCK - 1, row1);
+        for (int bx = col0 - col0 % BLOCK; bx <= col1; bx += BLOCK)
+        {
+            int c0 = max(bx, col0), c1 = min(bx + BLOCK - 1, col1);
+
+            bool reject = false, accept = true;
+            for (int i = 0; i < 3 && !reject; i++)
+            {
+                double e00 = A[i] * c0 + B[i] * r0 + C[i], e10 = A[i] * c1 + B[i] * r0 + C[i];
+                double e01 = A[i] * c0 + B[i] * r1 + C[i], e11 = A[i] * c1 + B[i] * r1 + C[i];
+                if (e00 < 0 && e10 < 0 && e01 < 0 && e11 < 0)
+                    reject = true;
+                if (e00 < 0 || e10 < 0 || e01 < 0 || e11 < 0)
+                    accept = false;
+            }
+            if (reject)
+                continue;
+
+            // depth range of the triangle over this block
+            bool inFront = false;
+            if (hiz.enabled)
+            {
+                double z00 = zA * c0 + zB * r0 + zC, z10 = zA * c1 + zB * r0 + zC;
+                double z01 = zA * c0 + zB * r1 + zC, z11 = zA * c1 + zB * r1 + zC;
+                double zNear = max(triNear, min({z00, z10, z01, z11}));
+                double zFar = min(triFar, max({z00, z10, z01, z11}));
+                if (hizBlockHidden(target, bx / BLOCK, by / BLOCK, zNear))
+                {
+                    if (STATS)
+                        stats.hizBlocksCulled++;
+                    continue;
+                }
+                inFront = is_same<Depth, DoubleDepth>::value && PASS == PASS_SINGLE && accept &&
+                          zNear - HIZ_EPS >= sc.z_front &&
+                          zFar + HIZ_EPS < hiz.zmin[(by / BLOCK) * hiz.blocksX + bx / BLOCK];
+            }
+
+            if (STATS)
+                stats.pixelsTested += (long long)(r1 - r0 + 1) * (c1 - c0 + 1);
+            double zLow = numeric_limits<double>::infinity(), zHigh = -zLow;
+            for (int row = r0; row <= r1; row++)
+            {
+                double zp = zA * c0 + zB * row + zC;
+                PixelRow<Depth> pr = pixelRow<Depth>(target, row);
+                if (inFront)
+                {
+                    for (int col = c0; col <= c1; col++, zp += zA)
+                    {
+                        pr.z[col] = depth.encode(zp);
+                        writeSpanPixel<STATS>(target, stats, pr.pixels, row, col, tri.color);
+                        zLow = min(zLow, zp);
+                        zHigh = max(zHigh, zp);
+                    }
+                    continue;
+                }
+                if (accept)
+                {
+                    for (int col = c0; col <= c1; col++, zp += zA)
+                        if (shadePixel<Depth, STATS, PASS>(depth, pr, row, col, zp, tri.color, sc, target, stats))
+                            zLow = min(zLow, zp);
+                    continue;
+                }
+                double e0 = A[0] * c0 + B[0] * row + C[0];
+                double e1 = A[1] * c0 + B[1] * row + C[1];
+                double e2 = A[2] * c0 + B[2] * row + C[2];
+                for (int col = c0; col <= c1; col++, e0 += A[0], e1 += A[1], e2 += A[2], zp += zA)
+                    if (((e0 >= 0) & (e1 >= 0) & (e2 >= 0)) &&
+                        shadePixel<Depth, STATS, PASS>(depth, pr, row, col, zp, tri.color, sc, target, stats))
+                        zLow = min(zLow, zp);
+            }
+
+            if (!hiz.enabled || PASS == PASS_COLOR || zLow == numeric_limits<double>::infinity())
+                continue;
+            bool wholeBlock = r0 == by && c0 == bx && r1 == min(by + BLOCK, sc.height) - 1 &&
+                              c1 == min(bx + BLOCK, sc.width) - 1;
+            if (inFront && wholeBlock)
+                hizSetBlock(hiz, bx / BLOCK, by / BLOCK, zLow, zHigh);
+            else
+                hizMarkWritten(hiz, bx / BLOCK, by / BLOCK, zLow);
+        }
+    }
+}
+
+// ==== Fixed-Point Scan Conversion ====
+// Vertices are snapped to 24.8 fixed point in pixel space (pixel centers on
+// integers, 1/256 pixel steps), so the edge functions
+// E(x, y) = du * (y - v) - dv * (x - u) are exact 64-bit integers. Pixels
+// exactly on an edge belong to the triangle only if it is a top edge
+// (horizontal, interior below) or a left edge (interior to its right). Two
+// triangles sharing an edge therefore cover every pixel along it exactly
+// once, and the whole-edge-on-the-pixel cases do not depend on which side
+// evaluated the edge. Each row's covered span is solved with integer
+// division per edge, so the pixel loop only interpolates depth.
+//
+// Coordinates beyond FIXED_LIMIT (2^21 pixels, where the products could
+// overflow) fall back to the half-space core; --clip keeps them in range.
+
+const int FIXED_SHIFT = 8;
+const long long FIXED_ONE = 1LL << FIXED_SHIFT;
+const double FIXED_LIMIT = 1 << 29; // in fixed units
+
+// floor(a / b) for b > 0
+inline long long floorDiv(long long a, long long b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// a triangle set up for the fixed-point cores: snapped vertices, edge
+// deltas with their fill rule bias, depth plane and covered pixel bounds
+struct FixedTriangle
+{
+    long long u[3], v[3], du[3], dv[3], bias[3];
+    double zA, zB, zC, zNear;
+    Rect bounds; // inside the clip rect
+};
+
+const int FIXED_EMPTY = 0, FIXED_READY = 1, FIXED_OUT_OF_RANGE = -1;
+
+int setupFixed(const Triangle &tri, const ScreenConfig &sc, const Rect &clip, FixedTriangle &f)
+{
+    long long *u = f.u, *v = f.v;
+    double z[3];
+    for (int i = 0; i < 3; i++)
+    {
+        double fu = (tri.points[i].x - sc.leftX) / sc.dx * FIXED_ONE;
+        double fv = (sc.topY - tri.points[i].y) / sc.dy * FIXED_ONE;
+        if (!(fabs(fu) < FIXED_LIMIT && fabs(fv) < FIXED_LIMIT))
+            return FIXED_OUT_OF_RANGE;
+        u[i] = llround(fu);
+        v[i] = llround(fv);
+        z[i] = tri.points[i].z;
+    }
+    long long area = (u[1] - u[0]) * (v[2] - v[0]) - (v[1] - v[0]) * (u[2] - u[0]);
+    if (area == 0)
+        return FIXED_EMPTY;
+    // clockwise on screen (v grows downward), so the interior is E >= 0
+    if (area < 0)
+    {
+        swap(u[1], u[2]);
+        swap(v[1], v[2]);
+        swap(z[1], z[2]);
+        area = -area;
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        int j = (i + 1) % 3;
+        f.du[i] = u[j] - u[i];
+        f.dv[i] = v[j] - v[i];
+        bool topLeft = (f.dv[i] == 0 && f.du[i] > 0) || f.dv[i] < 0;
+        f.bias[i] = topLeft ? 0 : -1;
+    }
+
+    // depth plane over the snapped vertices, in pixels
+    double pu[3], pv[3];
+    for (int i = 0; i < 3; i++)
+    {
+        pu[i] = (double)u[i] / FIXED_ONE;
+        pv[i] = (double)v[i] / FIXED_ONE;
+    }
+    double pArea = (double)area / (FIXED_ONE * FIXED_ONE);
+    f.zA = ((z[1] - z[0]) * (pv[2] - pv[0]) - (z[2] - z[0]) * (pv[1] - pv[0])) / pArea;
+    f.zB = ((z[2] - z[0]) * (pu[1] - pu[0]) - (z[1] - z[0]) * (pu[2] - pu[0])) / pArea;
+    f.zC = z[0] - f.zA * pu[0] - f.zB * pv[0];
+    f.zNear = min({z[0], z[1], z[2]});
+
+    Rect &r = f.bounds;
+    r.col0 = max((long long)clip.col0, floorDiv(min({u[0], u[1], u[2]}) + FIXED_ONE - 1, FIXED_ONE));
+    r.col1 = min((long long)clip.col1, floorDiv(max({u[0], u[1], u[2]}), FIXED_ONE));
+    r.row0 = max((long long)clip.row0, floorDiv(min({v[0], v[1], v[2]}) + FIXED_ONE - 1, FIXED_ONE));
+    r.row1 = min((long long)clip.row1, floorDiv(max({v[0], v[1], v[2]}), FIXED_ONE));
+    return r.col0 > r.col1 || r.row0 > r.row1 ? FIXED_EMPTY : FIXED_READY;
+}
+
+// the columns of row inside all three edges, within the bounds; false if none
+inline bool fixedRowSpan(const FixedTriangle &f, int row, int &left, int &right)
+{
+    long long y = row * FIXED_ONE;
+    left = f.bounds.col0;
+    right = f.bounds.col1;
+    for (int i = 0; i < 3 && left <= right; i++)
+    {
+        // E at column 0 (plus the fill rule bias) and its step per column
+        long long e = f.du[i] * (y - f.v[i]) + f.dv[i] * f.u[i] + f.bias[i];
+        long long step = -f.dv[i] * FIXED_ONE;
+        if (step > 0)
+            left = max((long long)left, floorDiv(-e + step - 1, step));
+        else if (step < 0)
+            right = min((long long)right, floorDiv(e, -step));
+        else if (e < 0)
+            right = left - 1;
+    }
+    return left <= right;
+}
+
+template <class Depth, bool STATS, int PASS>
+void rasterizeFixed(const Triangle &tri, const ScreenConfig &sc, const Rect &clip, RenderTarget &target, RasterStats &stats)
+{
+    FixedTriangle f;
+    int setup = setupFixed(tri, sc, clip, f);
+    if (setup == FIXED_OUT_OF_RANGE)
+        rasterizeHalfSpace<Depth, STATS, PASS>(tri, sc, clip, target, stats);
+    if (setup != FIXED_READY)
+        return;
+
+    HiZ &hiz = target.hiz;
+    if (hiz.enabled && hizRectHidden(target, f.bounds, f.zNear))
+        return;
+    Depth depth(sc);
+
+    for (int row = f.bounds.row0; row <= f.bounds.row1; row++)
+    {
+        if (STATS)
+            stats.scanlines++;
+        int left, right;
+        if (!fixedRowSpan(f, row, left, right))
+            continue;
+        if (STATS)
+            stats.pixelsTested += right - left + 1;
+
+        PixelRow<Depth> pr = pixelRow<Depth>(target, row);
+        double zp = f.zA * left + f.zB * row + f.zC;
+        bool wrote = false;
+        for (int col = left; col <= right; col++, zp += f.zA)
+            if (shadePixel<Depth, STATS, PASS>(depth, pr, row, col, zp, tri.color, sc, target, stats))
+                wrote = true;
+        if (hiz.enabled && wrote && PASS != PASS_COLOR)
+            for (int bx = left / BLOCK; bx <= right / BLOCK; bx++)
+                hizMarkWritten(hiz, bx, row / BLOCK, f.zNear - HIZ_EPS);
+    }
+}
+
+// ==== Multisample Anti-Aliasing ====
+// Coverage and depth are kept per sample (the standard 2/4/8x patterns, in
+// 1/16 pixel) as a float depth and a packed color, 8 bytes a sample against
+// 11 for a supersampled pixel of the double z-buffer and image. Coverage uses
+// the fixed-point core's exact edge functions and fill rule at each sample
+// position, solved as one span per sample and row, so the pixel loop builds a
+// coverage mask from span ends and depth-tests only the covered samples.
+// The flat color is packed once per triangle. The resolve averages sample colors into
+// the image and keeps the nearest sample depth for the z-buffer (see
+// Multisample Resolve).
+//
+// Triangles with vertices beyond FIXED_LIMIT are skipped; use --clip for
+// scenes that reach behind the eye.
+
+const int MSAA_PATTERN[4][8][2] = {
+    {{0, 0}},
+    {{4, 4}, {-4, -4}},
+    {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}},
+    {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}},
+};
+
+// sample s of an n-sample pixel, in fixed units from the pixel center
+inline int msaaOffset(int n, int s, int axis)
+{
+    int pattern = n == 8 ? 3 : n == 4 ? 2 : n == 2 ? 1 : 0;
+    return MSAA_PATTERN[pattern][s][axis] * (int)(FIXED_ONE / 16);
+}
+
+template <bool STATS>
+void rasterizeMsaa(const Triangle &tri, const ScreenConfig &sc, const Rect &clip, RenderTarget &target, RasterStats &stats)
+{
+    const int n = target.samples;
+    long long u[3], v[3];
+    double z[3];
+    for (int i = 0; i < 3; i++)
+    {
+        double fu = (tri.points[i].x - sc.leftX) / sc.dx * FIXED_ONE;
+        double fv = (sc.topY - tri.points[i].y) / sc.dy * FIXED_ONE;
+        if (!(fabs(fu) < FIXED_LIMIT && fabs(fv) < FIXED_LIMIT))
+            return;
+        u[i] = llround(fu);
+        v[i] = llround(fv);
+        z[i] = tri.points[i].z;
+    }
+    long long area = (u[1] - u[0]) * (v[2] - v[0]) - (v[1] - v[0]) * (u[2] - u[0]);
+    if (area == 0)
+        return;
+    if (area < 0)
+    {
+        swap(u[1], u[2]);
+        swap(v[1], v[2]);
+        swap(z[1], z[2]);
+        area = -area;
+    }
+
+    long long du[3], dv[3], bias[3];
+    for (int i = 0; i < 3; i++)
+    {
+        int j = (i + 1) % 3;
+        du[i] = u[j] - u[i];
+        dv[i] = v[j] - v[i];
+        bias[i] = (dv[i] == 0 && du[i] > 0) || dv[i] < 0 ? 0 : -1;
+    }
+
+    double pu[3], pv[3];
+    for (int i = 0; i < 3; i++)
+    {
+        pu[i] = (double)u[i] / FIXED_ONE;
+        pv[i] = (double)v[i] / FIXED_ONE;
+    }
+    double pArea = (double)area / (FIXED_ONE * FIXED_ONE);
+    double zA = ((z[1] - z[0]) * (pv[2] - pv[0]) - (z[2] - z[0]) * (pv[1] - pv[0])) / pArea;
+    double zB = ((z[2] - z[0]) * (pu[1] - pu[0]) - (z[1] - z[0]) * (pu[2] - pu[0])) / pArea;
+    double zC = z[0] - zA * pu[0] - zB * pv[0];
+
+    long long ox[8], oy[8];
+    double dz[8];
+    for (int s = 0; s < n; s++)
+    {
+        ox[s] = msaaOffset(n, s, 0);
+        oy[s] = msaaOffset(n, s, 1);
+        dz[s] = (zA * ox[s] + zB * oy[s]) / FIXED_ONE;
+    }
+
+    // samples sit less than half a pixel from their pixel's center
+    const long long half = FIXED_ONE / 2;
+    int col0 = max((long long)clip.col0, floorDiv(min({u[0], u[1], u[2]}) - half + FIXED_ONE - 1, FIXED_ONE));
+    int col1 = min((long long)clip.col1, floorDiv(max({u[0], u[1], u[2]}) + half, FIXED_ONE));
+    int row0 = max((long long)clip.row0, floorDiv(min({v[0], v[1], v[2]}) - half + FIXED_ONE - 1, FIXED_ONE));
+    int row1 = min((long long)clip.row1, floorDiv(max({v[0], v[1], v[2]}) + half, FIXED_ONE));
+    if (col0 > col1 || row0 > row1)
+        return;
+
+    uint32_t color = (uint32_t)tri.color.r << 16 | (uint32_t)tri.color.g << 8 | (uint32_t)tri.color.b;
+    int width = target.image.width();
+    for (int row = row0; row <= row1; row++)
+    {
+        // covered column span of every sample on this row
+        int left[8], right[8];
+        int rowLeft = col1 + 1, rowRight = col0 - 1;
+        for (int s = 0; s < n; s++)
+        {
+            long long y = row * FIXED_ONE + oy[s];
+            left[s] = col0;
+            right[s] = col1;
+            for (int i = 0; i < 3 && left[s] <= right[s]; i++)
+            {
+                long long e = du[i] * (y - v[i]) - dv[i] * (ox[s] - u[i]) + bias[i];
+                long long step = -dv[i] * FIXED_ONE;
+                if (step > 0)
+                    left[s] = max((long long)left[s], floorDiv(-e + step - 1, step));
+                else if (step < 0)
+                    right[s] = min((long long)right[s], floorDiv(e, -step));
+                else if (e < 0)
+                    right[s] = left[s] - 1;
+            }
+            if (left[s] <= right[s])
+            {
+                rowLeft = min(rowLeft, left[s]);
+                rowRight = max(rowRight, right[s]);
+            }
+        }
+        if (rowLeft > rowRight)
+            continue;
+        if (STATS)
+        {
+            stats.scanlines++;
+            stats.pixelsTested += rowRight - rowLeft + 1;
+        }
+
+        double zp = zA * rowLeft + zB * row + zC;
+        for (int col = rowLeft; col <= rowRight; col++, zp += zA)
+        {
+            size_t base = ((size_t)(row - target.rowOffset) * width + col) * n;
+            bool wrote = false;
+            for (int s = 0; s < n; s++)
+            {
+                if (col < left[s] || col > right[s])
+                    continue;
+                double zs = zp + dz[s];
+                float zf = (float)zs;
+                if (zs >= sc.z_front && zf < target.sampleZ[base + s])
+                {
+                    target.sampleZ[base + s] = zf;
+                    target.sampleColor[base + s] = color;
+                    wrote = true;
+                }
+            }
+            if (wrote)
+                countWrite<STATS>(target, stats, row, col);
+        }
+    }
+}
+
+typedef void (*RasterFn)(const Triangle &, const ScreenConfig &, const Rect &, RenderTarget &, RasterStats &);
+
+bool countingStats(const RenderOptions &opts)
+{
+    return !opts.stats.empty() || opts.heatmap;
+}
+
+template <class Depth, int PASS>
+RasterFn rasterCoreFor(const RenderOptions &opts)
+{
+    if (opts.raster == "halfspace")
+        return countingStats(opts) ? rasterizeHalfSpace<Depth, true, PASS> : rasterizeHalfSpace<Depth, false, PASS>;
+    if (opts.raster == "fixed")
+        return countingStats(opts) ? rasterizeFixed<Depth, true, PASS> : rasterizeFixed<Depth, false, PASS>;
+    return countingStats(opts) ? rasterizeScanline<Depth, true, PASS> : rasterizeScanline<Depth, false, PASS>;
+}
+
+template <class Depth>
+RasterFn rasterCoreFor(const RenderOptions &opts, int pass)
+{
+    if (pass == PASS_DEPTH)
+        return rasterCoreFor<Depth, PASS_DEPTH>(opts);
+    if (pass == PASS_COLOR)
+        return rasterCoreFor<Depth, PASS_COLOR>(opts);
+    return rasterCoreFor<Depth, PASS_SINGLE>(opts);
+}
+
+// pass: PASS_SINGLE, or one of the two --prepass passes
+RasterFn rasterCore(const RenderOptions &opts, int pass = PASS_SINGLE)
+{
+    if (opts.msaa > 1)
+        return countingStats(opts) ? rasterizeMsaa<true> : rasterizeMsaa<false>;
+    DepthFormat format = depthFormatOf(opts.depthFormat);
+    if (format == DEPTH_FLOAT32)
+        return rasterCoreFor<FloatDepth>(opts, pass);
+    if (format == DEPTH_UNORM24)
+        return rasterCoreFor<Unorm24Depth>(opts, pass);
+    return rasterCoreFor<DoubleDepth>(opts, pass);
+}
+
+// one raster core call, with the per-call counters
+inline void rasterizeCounted(RasterFn rasterize, const Triangle &tri, const ScreenConfig &sc, const Rect &clip,
+                             RenderTarget &target, RasterStats &stats)
+{
+    long long tested = stats.pixelsTested;
+    rasterize(tri, sc, clip, target, stats);
+    stats.calls++;
+    if (stats.pixelsTested == tested)
+        stats.culled++;
+}
+
+// region: the pixels the target holds (the whole screen, or one band)
+void scanConvert(const vector<Triangle> &triangles, const ScreenConfig &sc, const Rect &region, RenderTarget &target,
+                 RasterFn rasterize, RasterStats &stats)
+{
+    for (auto &tri : triangles)
+        rasterizeCounted(rasterize, tri, sc, region, target, stats);
+}
+
+// ==== Front-to-Back Ordering ====
+// With --sort, triangles reach the raster core nearest first, so hidden
+// pixels mostly fail the depth test instead of being written and then
+// overwritten. The key is a triangle's nearest z quantized to 16 bits over
+// z_front..z_rear, and the two-pass LSD radix sort is stable, so equal keys
+// keep file order. Only pixels where two triangles have the same stored
+// depth can change: the triangle sorted first keeps them. With double
+// depths that means exactly equal; float32, unorm24 and the float MSAA
+// samples round nearby depths together, so there it happens more often.
+//   scene  the whole scene is held back and sorted once before stage 4
+//          (memory grows with the triangle count, as with --band)
+//   tile   with --threads, each batch's tile lists are sorted by the worker
+//          that takes the tile; without, each batch is sorted
+
+const int SORT_KEY_BITS = 16;
+
+struct SortScratch
+{
+    vector<uint16_t> keys;
+    vector<int> order, tmp;
+    vector<Triangle> sorted;
+};
+
+inline uint16_t sortKey(const Triangle &tri, const ScreenConfig &sc)
+{
+    double zNear = min({tri.points[0].z, tri.points[1].z, tri.points[2].z});
+    double u = (zNear - sc.z_front) / (sc.z_rear - sc.z_front) * ((1 << SORT_KEY_BITS) - 1);
+    return !(u > 0) ? 0 : u >= (1 << SORT_KEY_BITS) - 1 ? (1 << SORT_KEY_BITS) - 1 : (uint16_t)u;
+}
+
+void computeSortKeys(const vector<Triangle> &triangles, const ScreenConfig &sc, vector<uint16_t> &keys)
+{
+    keys.resize(triangles.size());
+    for (size_t t = 0; t < triangles.size(); t++)
+        keys[t] = sortKey(triangles[t], sc);
+}
+
+// stable sort of triangle indices by keys[index], 8 bits a pass
+void radixSortByKey(vector<int> &items, const vector<uint16_t> &keys, vector<int> &tmp)
+{
+    tmp.resize(items.size());
+    for (int shift = 0; shift < SORT_KEY_BITS; shift += 8)
+    {
+        size_t start[257] = {};
+        for (int t : items)
+            start[(keys[t] >> shift & 255) + 1]++;
+        for (int b = 0; b < 256; b++)
+            start[b + 1] += start[b];
+        for (int t : items)
+            tmp[start[keys[t] >> shift & 255]++] = t;
+        items.swap(tmp);
+    }
+}
+
+void sortFrontToBack(vector<Triangle> &triangles, const ScreenConfig &sc, SortScratch &scratch)
+{
+    computeSortKeys(triangles, sc, scratch.keys);
+    scratch.order.resize(triangles.size());
+    iota(scratch.order.begin(), scratch.order.end(), 0);
+    radixSortByKey(scratch.order, scratch.keys, scratch.tmp);
+    scratch.sorted.clear();
+    for (int t : scratch.order)
+        scratch.sorted.push_back(triangles[t]);
+    triangles.swap(scratch.sorted);
+}
+
+// ==== Tile-Binned Parallel Scan Conversion ====
+
+// runs body(0..n-1) on a pool of worker threads that pull indices in order
+void parallelFor(int n, int threads, const function<void(int)> &body)
+{
+    atomic<int> next(0);
+    auto worker = [&]()
+    {
+        for (int i = next++; i < n; i = next++)
+            body(i);
+    };
+    vector<thread> pool;
+    for (int t = 1; t < min(threads, n); t++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &th : pool)
+        th.join();
+}
+
+// true if one of tri's edges has the whole pixel rect (grown by a pixel) on
+// its outer side, i.e. the triangle cannot cover any pixel in it
+bool edgesRejectRect(const Triangle &tri, const ScreenConfig &sc, const Rect &r)
+{
+    const Point *p = tri.points;
+    double area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[1].y - p[0].y) * (p[2].x - p[0].x);
+    if (area == 0)
+        return false;
+    double x0 = sc.leftX + (r.col0 - 1) * sc.dx, x1 = sc.leftX + (r.col1 + 1) * sc.dx;
+    double y0 = sc.topY - (r.row1 + 1) * sc.dy, y1 = sc.topY - (r.row0 - 1) * sc.dy;
+    for (int i = 0; i < 3; i++)
+    {
+        const Point &a = p[i], &b = p[(i + 1) % 3];
+        double ex = (b.x - a.x) * (area > 0 ? 1 : -1), ey = (b.y - a.y) * (area > 0 ? 1 : -1);
+        if (ex * (y0 - a.y) - ey * (x0 - a.x) < 0 && ex * (y0 - a.y) - ey * (x1 - a.x) < 0 &&
+            ex * (y1 - a.y) - ey * (x0 - a.x) < 0 && ex * (y1 - a.y) - ey * (x1 - a.x) < 0)
+            return true;
+    }
+    return false;
+}
+
+// per-tile triangle lists and counters, kept between batches for reuse
+struct TileBins
+{
+    vector<vector<int>> bins;
+    vector<RasterStats> stats;
+    bool sortTiles = false; // --sort tile
+    SortScratch sort;
+};
+
+// Bins every triangle into the screen tiles it can cover, then lets the
+// workers take whole tiles. A tile's bin keeps file order (or is sorted front
+// to back by its worker with sortTiles) and each worker only writes its own
+// tile's pixels, so the z-buffer and image need no locking and every pixel
+// sees the same sequence of depth tests as the serial loop. colorPass is the
+// --prepass second pass, run by each tile's worker after the first.
+void scanConvertTiled(const vector<Triangle> &triangles, const ScreenConfig &sc, const Rect &region,
+                      RenderTarget &target, RasterFn rasterize, int threads, int tileSize, RasterStats &stats,
+                      TileBins &scratch, RasterFn colorPass = nullptr)
+{
+    int tilesX = (region.col1 - region.col0 + tileSize) / tileSize;
+    int tilesY = (region.row1 - region.row0 + tileSize) / tileSize;
+    vector<vector<int>> &bins = scratch.bins;
+    bins.resize(tilesX * tilesY);
+    for (auto &bin : bins)
+        bin.clear();
+    if (scratch.sortTiles)
+        computeSortKeys(triangles, sc, scratch.sort.keys);
+
+    for (int t = 0; t < (int)triangles.size(); t++)
+    {
+        Rect r = triangleBounds(triangles[t], sc);
+        // samples off the pixel center can reach one row further
+        if (target.samples > 1)
+        {
+            r.row0--;
+            r.row1++;
+        }
+        // tile coordinates from here on are relative to the region
+        r.row0 = max(r.row0, region.row0) - region.row0;
+        r.row1 = min(r.row1, region.row1) - region.row0;
+        r.col0 = max(r.col0, region.col0) - region.col0;
+        r.col1 = min(r.col1, region.col1) - region.col0;
+        bool binned = false;
+        bool empty = r.row0 > r.row1 || r.col0 > r.col1;
+        bool single = r.row0 / tileSize == r.row1 / tileSize && r.col0 / tileSize == r.col1 / tileSize;
+        for (int ty = r.row0 / tileSize; ty <= r.row1 / tileSize && !empty; ty++)
+            for (int tx = r.col0 / tileSize; tx <= r.col1 / tileSize; tx++)
+            {
+                Rect tile = {region.row0 + ty * tileSize, region.row0 + (ty + 1) * tileSize - 1,
+                             region.col0 + tx * tileSize, region.col0 + (tx + 1) * tileSize - 1};
+                if (single || !edgesRejectRect(triangles[t], sc, tile))
+                {
+                    bins[ty * tilesX + tx].push_back(t);
+                    binned = true;
+                }
+            }
+        // a triangle in no tile is counted as one call that tested nothing
+        if (!binned)
+        {
+            stats.calls++;
+            stats.culled++;
+        }
+    }
+
+    vector<RasterStats> &tileStats = scratch.stats;
+    tileStats.assign(tilesX * tilesY, RasterStats());
+
+    parallelFor(tilesX * tilesY, threads, [&](int tile)
+    {
+        int tx = tile % tilesX, ty = tile / tilesX;
+        Rect clip;
+        clip.row0 = region.row0 + ty * tileSize;
+        clip.row1 = min(region.row1, clip.row0 + tileSize - 1);
+        clip.col0 = region.col0 + tx * tileSize;
+        clip.col1 = min(region.col1, clip.col0 + tileSize - 1);
+        if (scratch.sortTiles)
+        {
+            vector<int> tmp;
+            radixSortByKey(bins[tile], scratch.sort.keys, tmp);
+        }
+        for (int t : bins[tile])
+            rasterizeCounted(rasterize, triangles[t], sc, clip, target, tileStats[tile]);
+        if (colorPass)
+            for (int t : bins[tile])
+                rasterizeCounted(colorPass, triangles[t], sc, clip, target, tileStats[tile]);
+    });
+    for (auto &ts : tileStats)
+        stats.add(ts);
+}
+
+// ==== Z-Buffer Output ====
+// Rows are formatted with to_chars (same digits as fixed << setprecision(6))
+// into one buffer per row, a block of rows at a time across the worker
+// threads, and each block goes out in a single write.
+
+const int ZOUT_BLOCK_ROWS = 256;
+
+void formatZRow(const double *row, const ScreenConfig &sc, string &buf)
+{
+    buf.clear();
+    char num[64];
+    bool first = true;
+    for (int j = 0; j < sc.width; j++)
+    {
+        if (row[j] < sc.z_rear)
+        {
+            if (!first)
+                buf += '\t';
+            to_chars_result r = to_chars(num, num + sizeof num, row[j], chars_format::fixed, 6);
+            buf.append(num, r.ptr);
+            first = false;
+        }
+    }
+    buf += '\n';
+}
+
+// appends rows first..last of the z-buffer to zout
+void writeZRows(const DepthBuffer &zBuffer, const ScreenConfig &sc, int first, int last, ostream &zout, int threads)
+{
+    vector<string> rows(min(last - first + 1, ZOUT_BLOCK_ROWS));
+    vector<vector<double>> scratch(rows.size());
+    string block;
+    for (int row0 = first; row0 <= last; row0 += ZOUT_BLOCK_ROWS)
+    {
+        int n = min(ZOUT_BLOCK_ROWS, last - row0 + 1);
+        parallelFor(n, threads, [&](int i)
+        {
+            formatZRow(zBuffer.depths(row0 + i, scratch[i]), sc, rows[i]);
+        });
+        block.clear();
+        for (int i = 0; i < n; i++)
+            block += rows[i];
+        zout.write(block.data(), block.size());
+    }
+}
+
+void writeZBuffer(const DepthBuffer &zBuffer, const ScreenConfig &sc, const string &file, int threads)
+{
+    ofstream zout(file, ios::binary);
+    writeZRows(zBuffer, sc, 0, sc.height - 1, zout, threads);
+    zout.close();
+}
+
+// raw dump: width * height float32 depths, top row first, no header
+void writeZRowsRaw(const DepthBuffer &zBuffer, const ScreenConfig &sc, int first, int last, ostream &zout)
+{
+    vector<float> row(sc.width);
+    vector<double> scratch;
+    for (int i = first; i <= last; i++)
+    {
+        const double *z = zBuffer.depths(i, scratch);
+        copy(z, z + sc.width, row.begin());
+        zout.write((const char *)row.data(), row.size() * sizeof(float));
+    }
+}
+
+void writeZBufferRaw(const DepthBuffer &zBuffer, const ScreenConfig &sc, const string &file)
+{
+    ofstream zout(file, ios::binary);
+    writeZRowsRaw(zBuffer, sc, 0, sc.height - 1, zout);
+    zout.close();
+}
+
+// ==== Z-Buffer Comparison ====
+// Checks a z-buffer.txt against a reference such as Resources/N/z_buffer.txt
+// (trailing tabs are ignored). Rows only list their covered pixels, so
+// values are compared by position within rows of the same length; a row of
+// another length means edge pixels were decided differently. Prints the
+// summary and returns true if every row has the same length and every
+// value is within tolerance.
+
+bool readZRows(const string &file, vector<vector<double>> &rows)
+{
+    ifstream in(file);
+    if (!in)
+    {
+        cerr << "cannot open " << file << "\n";
+        return false;
+    }
+    string line;
+    while (getline(in, line))
+    {
+        rows.emplace_back();
+        const char *p = line.c_str();
+        char *end;
+        for (double z = strtod(p, &end); end != p; z = strtod(p, &end))
+        {
+            rows.back().push_back(z);
+            p = end;
+        }
+    }
+    return true;
+}
+
+bool compareZBufferFiles(const string &refFile, const string &file, double tolerance)
+{
+    vector<vector<double>> ref, cur;
+    if (!readZRows(refFile, ref) || !readZRows(file, cur))
+        return false;
+    size_t rows = max(ref.size(), cur.size()), lengthDiffs = 0, compared = 0, over = 0;
+    double maxDiff = 0;
+    for (size_t r = 0; r < rows; r++)
+    {
+        if (r >= ref.size() || r >= cur.size() || ref[r].size() != cur[r].size())
+        {
+            lengthDiffs++;
+            continue;
+        }
+        for (size_t i = 0; i < ref[r].size(); i++)
+        {
+            double d = fabs(ref[r][i] - cur[r][i]);
+            maxDiff = max(maxDiff, d);
+            compared++;
+            over += d > tolerance * (1 + 1e-9); // the printed digits are not exact
+        }
+    }
+    printf("rows: %zu, of other length: %zu\nvalues compared: %zu, over %g: %zu, max |diff|: %g\n", rows,
+           lengthDiffs, compared, tolerance, over, maxDiff);
+    return lengthDiffs == 0 && over == 0;
+}
+
+// ==== Banded BMP Output ====
+// Writes out.bmp one band of rows at a time. The header matches
+// bitmap_image::save_image; BMP stores the bottom row first, so a band
+// (top rows first) lands as one contiguous run of file rows, written
+// bottom-up after a seek. Sizes past 4 GB do not fit the header fields and
+// are written as 0, which readers accept for uncompressed images.
+
+struct BandedBmpWriter
+{
+    ofstream out;
+    int width, height;
+    size_t stride;
+
+    BandedBmpWriter(const string &file, int width, int height)
+        : out(file, ios::binary), width(width), height(height), stride(((size_t)width * 3 + 3) & ~(size_t)3)
+    {
+        uint64_t imageBytes = stride * height;
+        uint32_t sizeImage = imageBytes + 55 <= UINT32_MAX ? (uint32_t)imageBytes : 0;
+        auto put16 = [&](uint16_t v) { out.write((const char *)&v, 2); };
+        auto put32 = [&](uint32_t v) { out.write((const char *)&v, 4); };
+        put16(19778);
+        put32(sizeImage ? sizeImage + 55 : 0);
+        put16(0);
+        put16(0);
+        put32(54);
+        put32(40);
+        put32(width);
+        put32(height);
+        put16(1);
+        put16(24);
+        put32(0);
+        put32(sizeImage);
+        put32(0);
+        put32(0);
+        put32(0);
+        put32(0);
+    }
+
+    // image holds screen rows row0..row0 + image.height() - 1
+    void writeBand(const bitmap_image &image, int row0)
+    {
+        int rows = image.height();
+        out.seekp(54 + (streamoff)(height - row0 - rows) * stride);
+        vector<char> line(stride, 0);
+        for (int i = rows - 1; i >= 0; i--)
+        {
+            copy(image.row(i), image.row(i) + (size_t)width * 3, line.begin());
+            out.write(line.data(), stride);
+        }
+    }
+};
+
+// ==== Pipeline Statistics ====
+// Stage timers and the stage 4 counters of one run, written at exit as
+// stats.json or stats.csv. The timers are always kept (the benchmark reads
+// them); the counters are only collected with --stats or --heatmap.
+
+struct PipelineStats
+{
+    vector<pair<string, double>> timers; // seconds, in the order they ran
+    long long trianglesIn = 0;           // triangles handed to stage 4
+    long long coveredPixels = 0;         // pixels holding a depth at the end
+    RasterStats raster;
+};
+
+thread_local PipelineStats pipelineStats; // per batch job
+
+double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+template <class F>
+void timeStage(const string &name, F body)
+{
+    auto start = chrono::steady_clock::now();
+    body();
+    pipelineStats.timers.push_back({name, secondsSince(start)});
+}
+
+void writeStatsReport(const PipelineStats &st, const string &format, const string &dir)
+{
+    const RasterStats &r = st.raster;
+    double overdraw = st.coveredPixels ? (double)r.pixelWrites / st.coveredPixels : 0;
+    vector<pair<string, long long>> counters = {
+        {"triangles_in", st.trianglesIn},
+        {"raster_calls", r.calls},
+        {"triangles_culled", r.culled},
+        {"scanlines", r.scanlines},
+        {"pixels_tested", r.pixelsTested},
+        {"depth_passes", r.depthPasses},
+        {"pixel_writes", r.pixelWrites},
+        {"hiz_blocks_culled", r.hizBlocksCulled},
+        {"prepass_color_writes", r.prepassColorWrites},
+        {"covered_pixels", st.coveredPixels},
+    };
+
+    ofstream out(inDir(dir, format == "csv" ? "stats.csv" : "stats.json"));
+    out << fixed << setprecision(6);
+    if (format == "csv")
+    {
+        out << "name,value\n";
+        for (auto &t : st.timers)
+            out << "time_" << t.first << "_s," << t.second << "\n";
+        for (auto &c : counters)
+            out << c.first << "," << c.second << "\n";
+        out << "overdraw," << overdraw << "\n";
+        return;
+    }
+    out << "{\n  \"timers_s\": {";
+    for (size_t i = 0; i < st.timers.size(); i++)
+        out << (i ? ", " : "") << "\"" << st.timers[i].first << "\": " << st.timers[i].second;
+    out << "},\n";
+    for (auto &c : counters)
+        out << "  \"" << c.first << "\": " << c.second << ",\n";
+    out << "  \"overdraw\": " << overdraw << "\n}\n";
+}
+
+// writes per pixel counts as a jet colormap image; black = never written,
+// dark blue = once, red = the most written pixel
+void writeOverdrawHeatmap(const vector<uint32_t> &overdraw, const ScreenConfig &sc, const string &file)
+{
+    uint32_t most = max<uint32_t>(1, *max_element(overdraw.begin(), overdraw.end()));
+    bitmap_image heat(sc.width, sc.height);
+    heat.set_all_channels(0, 0, 0);
+    for (int row = 0; row < sc.height; row++)
+        for (int col = 0; col < sc.width; col++)
+        {
+            uint32_t n = overdraw[(size_t)row * sc.width + col];
+            if (n == 0)
+                continue;
+            const rgb_store &c = jet_colormap[most == 1 ? 0 : (n - 1) * 999 / (most - 1)];
+            heat.set_pixel(col, row, c.red, c.green, c.blue);
+        }
+    heat.save_image(file);
+}
+
+// ==== Triangle-Parallel Scan Conversion ====
+// The other way to use several threads: instead of giving each thread whole
+// screen tiles, the triangles of a batch are cut into work items of up to
+// ATOMIC_ROWS rows and the items are shared out, so a few huge triangles
+// spread over all threads as well as many small ones. Every pixel holds one
+// 64-bit word, the depth as an order-preserving 47-bit key above a 17-bit
+// triangle id (its position in the batch, plus one), and a depth test is an
+// atomic min by compare-and-swap. The smallest word wins whatever order the
+// threads ran in: the nearest depth, and on equal keys the earlier triangle,
+// as in the serial loop. After each batch a parallel pass writes the
+// winners' colors and exact depths into the image and z-buffer and clears
+// the ids, so pixels kept from earlier batches (id 0) also win ties.
+// Coverage and depth are the fixed-point core's, and the key is taken from
+// the depth as --depth-format stores it, so float32 and unorm24 ties go to
+// the earlier triangle as well; only double depths closer than the key's
+// precision (about 1e-10 relative) can pick another winner.
+//
+// Triangles with vertices beyond FIXED_LIMIT take the fixed core's
+// half-space fallback, one at a time in batch order, after which the words
+// are reloaded from the z-buffer; --clip keeps them in range. --raster
+// does not apply: coverage is always the fixed core's.
+
+const int ATOMIC_ID_BITS = 17;
+const uint64_t ATOMIC_ID_MASK = (1ULL << ATOMIC_ID_BITS) - 1;
+const int ATOMIC_ROWS = 16;
+
+// top 47 bits of the double's bits, flipped so that unsigned order is
+// numeric order
+inline uint64_t depthKey(double z)
+{
+    uint64_t bits;
+    memcpy(&bits, &z, sizeof bits);
+    bits = bits >> 63 ? ~bits : bits | 1ULL << 63;
+    return bits >> ATOMIC_ID_BITS;
+}
+
+void initDepthWords(RenderTarget &target, const ScreenConfig &sc)
+{
+    size_t pixels = (size_t)sc.width * sc.height;
+    if (target.depthWordCount != pixels)
+    {
+        target.depthWords.reset(new atomic<uint64_t>[pixels]);
+        target.depthWordCount = pixels;
+    }
+    uint64_t empty = depthKey(sc.z_rear) << ATOMIC_ID_BITS;
+    for (size_t i = 0; i < pixels; i++)
+        target.depthWords[i].store(empty, memory_order_relaxed);
+}
+
+// rows r0..r1 of one set-up triangle with the given id
+template <class Depth>
+void rasterizeAtomicRows(const FixedTriangle &f, uint64_t id, int r0, int r1, const ScreenConfig &sc,
+                         RenderTarget &target, RasterStats &stats)
+{
+    Depth depth(sc);
+    for (int row = r0; row <= r1; row++)
+    {
+        stats.scanlines++;
+        int left, right;
+        if (!fixedRowSpan(f, row, left, right))
+            continue;
+        stats.pixelsTested += right - left + 1;
+        atomic<uint64_t> *words = &target.depthWords[(size_t)row * sc.width];
+        double zp = f.zA * left + f.zB * row + f.zC;
+        for (int col = left; col <= right; col++, zp += f.zA)
+        {
+            if (!(zp >= sc.z_front && zp < sc.z_rear))
+                continue;
+            uint64_t word = depthKey(depth.decode(depth.encode(zp))) << ATOMIC_ID_BITS | id;
+            uint64_t current = words[col].load(memory_order_relaxed);
+            while (word < current)
+                if (words[col].compare_exchange_weak(current, word, memory_order_relaxed))
+                {
+                    stats.depthPasses++;
+                    break;
+                }
+        }
+    }
+}
+
+// colors and depths of the winners of one row into the targets; the depth
+// is stepped from the span's left end as the rasterizer did, so it matches
+// bit for bit
+long long resolveAtomicRow(const vector<Triangle> &triangles, const vector<FixedTriangle> &setups, int first,
+                           int row, const ScreenConfig &sc, RenderTarget &target)
+{
+    long long writes = 0;
+    atomic<uint64_t> *words = &target.depthWords[(size_t)row * sc.width];
+    uint64_t lastId = 0;
+    int lastCol = 0;
+    double zp = 0;
+    for (int col = 0; col < sc.width; col++)
+    {
+        uint64_t word = words[col].load(memory_order_relaxed);
+        uint64_t id = word & ATOMIC_ID_MASK;
+        if (!id)
+            continue;
+        const FixedTriangle &f = setups[first + id - 1];
+        if (id != lastId)
+        {
+            int right;
+            fixedRowSpan(f, row, lastCol, right);
+            zp = f.zA * lastCol + f.zB * row + f.zC;
+            lastId = id;
+        }
+        for (; lastCol < col; lastCol++)
+            zp += f.zA;
+        const Color &c = triangles[first + id - 1].color;
+        target.zBuffer.set(row, col, zp);
+        target.image.set_pixel(col, row - target.rowOffset, c.r, c.g, c.b);
+        words[col].store(word & ~ATOMIC_ID_MASK, memory_order_relaxed);
+        writes++;
+    }
+    return writes;
+}
+
+// the words of rows the z-buffer was written to directly, rebuilt from it
+void reloadDepthWords(RenderTarget &target, const ScreenConfig &sc, int threads)
+{
+    parallelFor(sc.height, threads, [&](int row)
+    {
+        atomic<uint64_t> *words = &target.depthWords[(size_t)row * sc.width];
+        for (int col = 0; col < sc.width; col++)
+            words[col].store(depthKey(target.zBuffer.get(row, col)) << ATOMIC_ID_BITS, memory_order_relaxed);
+    });
+}
+
+void scanConvertAtomic(const vector<Triangle> &triangles, const ScreenConfig &sc, RenderTarget &target, int threads,
+                       RasterStats &stats)
+{
+    int n = triangles.size();
+    Rect screen = {0, sc.height - 1, 0, sc.width - 1};
+    vector<FixedTriangle> setups(n);
+    vector<signed char> setup(n);
+    parallelFor((n + 1023) / 1024, threads, [&](int chunk)
+    {
+        for (int t = chunk * 1024; t < min(n, chunk * 1024 + 1024); t++)
+            setup[t] = setupFixed(triangles[t], sc, screen, setups[t]);
+    });
+
+    DepthFormat format = target.zBuffer.format;
+    auto atomicRows = format == DEPTH_FLOAT32   ? rasterizeAtomicRows<FloatDepth>
+                      : format == DEPTH_UNORM24 ? rasterizeAtomicRows<Unorm24Depth>
+                                                : rasterizeAtomicRows<DoubleDepth>;
+    RasterFn halfSpace = format == DEPTH_FLOAT32   ? rasterizeHalfSpace<FloatDepth, true, PASS_SINGLE>
+                         : format == DEPTH_UNORM24 ? rasterizeHalfSpace<Unorm24Depth, true, PASS_SINGLE>
+                                                   : rasterizeHalfSpace<DoubleDepth, true, PASS_SINGLE>;
+
+    // rounds of up to ATOMIC_ID_MASK triangles (the ids' range), cut short
+    // before a triangle out of fixed-point range
+    for (int first = 0, last; first < n; first = last)
+    {
+        if (setup[first] == FIXED_OUT_OF_RANGE)
+        {
+            // the fixed core's fallback, in order on the z-buffer itself
+            for (last = first; last < n && setup[last] == FIXED_OUT_OF_RANGE; last++)
+                rasterizeCounted(halfSpace, triangles[last], sc, screen, target, stats);
+            reloadDepthWords(target, sc, threads);
+            continue;
+        }
+        vector<array<int, 3>> items; // triangle, first row, last row
+        for (last = first; last < n && last - first < (int)ATOMIC_ID_MASK && setup[last] != FIXED_OUT_OF_RANGE; last++)
+        {
+            stats.calls++;
+            if (setup[last] != FIXED_READY)
+            {
+                stats.culled++;
+                continue;
+            }
+            const Rect &r = setups[last].bounds;
+            for (int row = r.row0; row <= r.row1; row += ATOMIC_ROWS)
+                items.push_back({last, row, min(r.row1, row + ATOMIC_ROWS - 1)});
+        }
+
+        atomic<size_t> next(0);
+        vector<RasterStats> threadStats(threads);
+        parallelFor(threads, threads, [&](int worker)
+        {
+            for (size_t i = next++; i < items.size(); i = next++)
+                atomicRows(setups[items[i][0]], items[i][0] - first + 1, items[i][1], items[i][2], sc, target,
+                           threadStats[worker]);
+        });
+        for (auto &ts : threadStats)
+            stats.add(ts);
+
+        vector<long long> rowWrites(sc.height);
+        parallelFor(sc.height, threads, [&](int row)
+        {
+            rowWrites[row] = resolveAtomicRow(triangles, setups, first, row, sc, target);
+        });
+        stats.pixelWrites += accumulate(rowWrites.begin(), rowWrites.end(), 0LL);
+    }
+}
+
+// ==== Multisample Resolve ====
+
+// averages the samples of every pixel in rows row0..row1 into the image and
+// keeps the nearest sample depth in the z-buffer
+void resolveSamples(RenderTarget &target, const ScreenConfig &sc, int row0, int row1, int threads)
+{
+    int n = target.samples;
+    parallelFor(row1 - row0 + 1, threads, [&](int i)
+    {
+        int row = row0 + i;
+        for (int col = 0; col < sc.width; col++)
+        {
+            size_t base = ((size_t)i * sc.width + col) * n;
+            int r = 0, g = 0, b = 0;
+            float zMin = target.sampleZ[base];
+            for (int s = 0; s < n; s++)
+            {
+                uint32_t c = target.sampleColor[base + s];
+                r += c >> 16 & 255;
+                g += c >> 8 & 255;
+                b += c & 255;
+                zMin = min(zMin, target.sampleZ[base + s]);
+            }
+            target.image.set_pixel(col, i, (r + n / 2) / n, (g + n / 2) / n, (b + n / 2) / n);
+            target.zBuffer.set(row, col, zMin < (float)sc.z_rear ? (double)zMin : sc.z_rear);
+        }
+    });
+}
+
+// ==== Render Target Setup ====
+
+// sizes target for sc and the sample count, hi-z and heatmap of opts and
+// clears it, reusing the allocations of an earlier frame of the same size
+void prepareTarget(RenderTarget &target, const ScreenConfig &sc, const RenderOptions &opts)
+{
+    target.rowOffset = 0;
+    target.samples = opts.msaa;
+    size_t pixels = (size_t)sc.width * sc.height;
+    if (opts.msaa > 1)
+    {
+        target.sampleZ.assign(pixels * opts.msaa, (float)sc.z_rear);
+        target.sampleColor.assign(pixels * opts.msaa, 0);
+    }
+    target.zBuffer.reset(sc, depthFormatOf(opts.depthFormat), 0, sc.height);
+    if ((int)target.image.width() != sc.width || (int)target.image.height() != sc.height)
+        target.image = bitmap_image(sc.width, sc.height);
+    target.image.set_all_channels(0, 0, 0);
+    // a hi-z group must not straddle two tiles of the threaded path
+    target.hiz.enabled = false;
+    if (opts.hiz)
+        initHiZ(target.hiz, sc, opts.threads > 1 ? opts.tileSize : 64);
+    if (opts.heatmap)
+        target.overdraw.assign(pixels, 0);
+    if (opts.triangleParallel)
+        initDepthWords(target, sc);
+    if (opts.prepass)
+        target.pending.assign(pixels, 0);
+}
+
+// ==== Streaming Stage 4 ====
+// Triangles are scan converted in batches as they arrive instead of after the
+// whole scene is loaded, so memory does not grow with the triangle count.
+// Batches go through in file order into the same render target, so the
+// output matches rasterizing everything at once. --sort scene holds every
+// triangle back as one batch instead.
+//
+// With bandRows the screen is rendered in horizontal bands instead, for
+// images too large to hold: triangles are kept and listed per band they
+// touch, and finish() renders one band at a time with only that band's
+// z-buffer rows, image and samples allocated, appending its rows to
+// z-buffer.txt and out.bmp before the next. Each band sees its triangles in
+// file order, so the output matches the unbanded run.
+
+const size_t STREAM_BATCH = 1 << 16;
+
+// scan converts a batch (reordered with --sort, in two passes with
+// --prepass) on the serial or tiled path
+void scanConvertBatch(vector<Triangle> &batch, const ScreenConfig &sc, const Rect &region, RenderTarget &target,
+                      const RenderOptions &opts, RasterStats &stats, TileBins &bins)
+{
+    bins.sortTiles = opts.sort == "tile" && opts.threads > 1;
+    if (!opts.sort.empty() && !bins.sortTiles)
+        sortFrontToBack(batch, sc, bins.sort);
+    RasterFn rasterize = rasterCore(opts, opts.prepass ? PASS_DEPTH : PASS_SINGLE);
+    RasterFn colorPass = opts.prepass ? rasterCore(opts, PASS_COLOR) : nullptr;
+    if (opts.threads > 1)
+        scanConvertTiled(batch, sc, region, target, rasterize, opts.threads, opts.tileSize, stats, bins, colorPass);
+    else
+    {
+        scanConvert(batch, sc, region, target, rasterize, stats);
+        if (colorPass)
+            scanConvert(batch, sc, region, target, colorPass, stats);
+    }
+}
+
+struct TriangleStream
+{
+    ScreenConfig sc;
+    RenderOptions opts;
+    RenderTarget target;
+    vector<Triangle> batch;
+    TileBins bins;
+    RasterStats stats;
+    long long trianglesIn = 0;
+    double rasterSeconds = 0;
+    vector<Triangle> kept;             // band mode: every triangle, rendered in finish()
+    vector<vector<uint32_t>> bandLists; // band mode: indices into kept, per band
+
+    TriangleStream(const ScreenConfig &sc, const RenderOptions &opts) : sc(sc), opts(opts)
+    {
+        target.samples = opts.msaa;
+        if (opts.bandRows > 0)
+        {
+            bandLists.resize((sc.height + opts.bandRows - 1) / opts.bandRows);
+            return;
+        }
+        prepareTarget(target, sc, opts);
+        batch.reserve(STREAM_BATCH);
+    }
+
+    void push(const Triangle &tri)
+    {
+        trianglesIn++;
+        if (opts.bandRows > 0)
+        {
+            keep(tri);
+            return;
+        }
+        batch.push_back(tri);
+        if (batch.size() == STREAM_BATCH && opts.sort != "scene")
+            flush();
+    }
+
+    void keep(const Triangle &tri)
+    {
+        Rect r = triangleBounds(tri, sc);
+        if (target.samples > 1)
+        {
+            r.row0 = max(0, r.row0 - 1);
+            r.row1 = min(sc.height - 1, r.row1 + 1);
+        }
+        if (r.row0 > r.row1 || r.col0 > r.col1)
+        {
+            // counted like a triangle the raster core found nothing for
+            stats.calls++;
+            stats.culled++;
+            return;
+        }
+        for (int b = r.row0 / opts.bandRows; b <= r.row1 / opts.bandRows; b++)
+            bandLists[b].push_back(kept.size());
+        kept.push_back(tri);
+    }
+
+    // scan converts the batch into the pixels of region
+    void rasterize(const Rect &region)
+    {
+        auto start = chrono::steady_clock::now();
+        if (opts.triangleParallel)
+            scanConvertAtomic(batch, sc, target, opts.threads, stats);
+        else
+            scanConvertBatch(batch, sc, region, target, opts, stats, bins);
+        batch.clear();
+        rasterSeconds += secondsSince(start);
+    }
+
+    void flush()
+    {
+        rasterize({0, sc.height - 1, 0, sc.width - 1});
+    }
+
+    // rasterizes what is left; multisampled targets are resolved into the
+    // z-buffer and image
+    void resolve()
+    {
+        flush();
+        if (target.samples == 1)
+            return;
+        auto start = chrono::steady_clock::now();
+        resolveSamples(target, sc, 0, sc.height - 1, opts.threads);
+        target.sampleZ = vector<float>();
+        target.sampleColor = vector<uint32_t>();
+        rasterSeconds += secondsSince(start);
+    }
+
+    // rasterizes what is left and writes z-buffer.txt (and z-buffer.f32) and
+    // out.bmp, plus overdraw.bmp and the stage 4 statistics when asked for
+    void finish()
+    {
+        if (opts.bandRows > 0)
+        {
+            finishBands();
+            return;
+        }
+        resolve();
+        pipelineStats.timers.push_back({"stage4_raster", rasterSeconds});
+        timeStage("stage4_output", [&]
+        {
+            writeZBuffer(target.zBuffer, sc, inDir(opts.dir, "z-buffer.txt"), opts.threads);
+            if (opts.zRaw)
+                writeZBufferRaw(target.zBuffer, sc, inDir(opts.dir, "z-buffer.f32"));
+            target.image.save_image(inDir(opts.dir, "out.bmp"));
+        });
+        pipelineStats.trianglesIn += trianglesIn;
+        if (!countingStats(opts))
+            return;
+        pipelineStats.raster.add(stats);
+        vector<double> scratch;
+        for (int row = 0; row < sc.height; row++)
+        {
+            const double *z = target.zBuffer.depths(row, scratch);
+            pipelineStats.coveredPixels += count_if(z, z + sc.width, [&](double d) { return d < sc.z_rear; });
+        }
+        if (opts.heatmap)
+            writeOverdrawHeatmap(target.overdraw, sc, inDir(opts.dir, "overdraw.bmp"));
+    }
+
+    void finishBands()
+    {
+        double outputSeconds = 0;
+        ofstream zout(inDir(opts.dir, "z-buffer.txt"), ios::binary), zraw;
+        if (opts.zRaw)
+            zraw.open(inDir(opts.dir, "z-buffer.f32"), ios::binary);
+        BandedBmpWriter bmp(inDir(opts.dir, "out.bmp"), sc.width, sc.height);
+        vector<double> scratch;
+        for (int b = 0; b < (int)bandLists.size(); b++)
+        {
+            int row0 = b * opts.bandRows, row1 = min(sc.height, row0 + opts.bandRows) - 1;
+            size_t pixels = (size_t)sc.width * (row1 - row0 + 1);
+            target.rowOffset = row0;
+            target.image = bitmap_image(sc.width, row1 - row0 + 1);
+            target.image.set_all_channels(0, 0, 0);
+            if (target.samples > 1)
+            {
+                target.sampleZ.assign(pixels * target.samples, (float)sc.z_rear);
+                target.sampleColor.assign(pixels * target.samples, 0);
+            }
+            target.zBuffer.reset(sc, depthFormatOf(opts.depthFormat), row0, row1 - row0 + 1);
+            if (opts.prepass)
+                target.pending.assign(pixels, 0);
+
+            for (uint32_t t : bandLists[b])
+                batch.push_back(kept[t]);
+            bandLists[b] = vector<uint32_t>();
+            rasterize({row0, row1, 0, sc.width - 1});
+            if (target.samples > 1)
+            {
+                auto start = chrono::steady_clock::now();
+                resolveSamples(target, sc, row0, row1, opts.threads);
+                rasterSeconds += secondsSince(start);
+            }
+
+            auto start = chrono::steady_clock::now();
+            writeZRows(target.zBuffer, sc, row0, row1, zout, opts.threads);
+            if (opts.zRaw)
+                writeZRowsRaw(target.zBuffer, sc, row0, row1, zraw);
+            bmp.writeBand(target.image, row0);
+            outputSeconds += secondsSince(start);
+            if (countingStats(opts))
+                for (int row = row0; row <= row1; row++)
+                {
+                    const double *z = target.zBuffer.depths(row, scratch);
+                    pipelineStats.coveredPixels += count_if(z, z + sc.width, [&](double d) { return d < sc.z_rear; });
+                }
+        }
+        pipelineStats.trianglesIn += trianglesIn;
+        pipelineStats.timers.push_back({"stage4_raster", rasterSeconds});
+        pipelineStats.timers.push_back({"stage4_output", outputSeconds});
+        if (countingStats(opts))
+            pipelineStats.raster.add(stats);
+    }
+};
+
+bool stage4(const RenderOptions &opts)
+{
+    StageReader in(3, opts.stageFormat, opts.dir);
+    TriangleStream stream(readScreenConfig(inDir(opts.dir, "config.txt")), opts);
+
+    Triangle tri;
+    while (in.read(tri.points))
+    {
+        tri.color = Color(colorRand() % 256, colorRand() % 256, colorRand() % 256);
+        stream.push(tri);
+    }
+    stream.finish();
+    return in.ok;
+}
+
+// ==== Group Culling ====
+
+const double CULL_EPS = 1e-7; // slack in normalized device units
+
+// false only if box b, taken to clip space by m, cannot put a pixel on the
+// screen: every corner is in front of the eye (w > 0) and all of them lie
+// beyond the same side of the screen window or the z_front..z_rear range.
+// With w > 0 everywhere the projected box is the hull of its projected
+// corners, so this is exact up to the slack.
+bool boxMayBeVisible(const Mat4 &m, const Bounds &b, const ScreenConfig &sc)
+{
+    if (b.empty())
+        return false;
+    int common = 63;
+    for (int i = 0; i < 8 && common; i++)
+    {
+        Point c = multiply(m, Point(i & 1 ? b.hi.x : b.lo.x, i & 2 ? b.hi.y : b.lo.y, i & 4 ? b.hi.z : b.lo.z));
+        if (!(c.w > 0))
+            return true;
+        int code = 0;
+        if (c.x < (sc.x_left - CULL_EPS) * c.w)
+            code |= 1;
+        if (c.x > (sc.x_right + CULL_EPS) * c.w)
+            code |= 2;
+        if (c.y < (sc.y_bottom - CULL_EPS) * c.w)
+            code |= 4;
+        if (c.y > (sc.y_top + CULL_EPS) * c.w)
+            code |= 8;
+        if (c.z < (sc.z_front - CULL_EPS) * c.w)
+            code |= 16;
+        if (c.z > (sc.z_rear + CULL_EPS) * c.w)
+            code |= 32;
+        common &= code;
+    }
+    return common == 0;
+}
+
+// ==== In-Memory Fused Pipeline ====
+// Runs stages 1-3 without the intermediate text files: each triangle goes
+// through one pre-multiplied projection * view * model matrix, rebuilt only
+// when the matrix stack top changes, and straight into the stage 4 stream.
+// With debugStages the stage1/2/3.txt files are still written, using the
+// per-stage matrices. False if a mesh could not be loaded.
+bool fusedPipeline(const RenderOptions &opts)
+{
+    bool debugStages = opts.debugStages;
+    SceneScanner in(inDir(opts.dir, "scene.txt"));
+    Camera cam = readCamera(in);
+    Mat4 V = viewMatrix(cam);
+    Mat4 P = projectionMatrix(cam);
+    Mat4 VP = multiply(P, V);
+
+    unique_ptr<StageWriter> out1, out2, out3;
+    if (debugStages)
+    {
+        out1.reset(new StageWriter(1, opts.stageFormat, opts.dir));
+        out2.reset(new StageWriter(2, opts.stageFormat, opts.dir));
+        out3.reset(new StageWriter(3, opts.stageFormat, opts.dir));
+    }
+
+    TriangleStream stream(readScreenConfig(inDir(opts.dir, "config.txt")), opts);
+    Mat4 MVP = VP;
+    ClipStats clipStats;
+
+    // hands a triangle in clip space (or already divided by w) to stage 4
+    auto emit = [&](Triangle &tri, bool divided)
+    {
+        Point pieces[7][3];
+        int count = 1;
+        if (opts.clip && !divided)
+            count = clipTriangle(tri.points, pieces, clipStats);
+        else
+            for (int i = 0; i < 3; i++)
+            {
+                pieces[0][i] = tri.points[i];
+                if (!divided)
+                    pieces[0][i].normalize();
+            }
+        for (int k = 0; k < count; k++)
+        {
+            copy(pieces[k], pieces[k] + 3, tri.points);
+            stream.push(tri);
+            if (debugStages)
+                out3->write(tri.points);
+        }
+    };
+
+    SceneInterpreter scene;
+    scene.dir = opts.dir;
+    long long mvpVersion = 0;
+    // the stack top the current MVP was built from
+    auto refreshMVP = [&]()
+    {
+        if (scene.version != mvpVersion && !debugStages)
+        {
+            MVP = multiply(VP, scene.top());
+            mvpVersion = scene.version;
+        }
+    };
+    scene.onTriangle = [&](Point p[3])
+    {
+        refreshMVP();
+        if (debugStages)
+        {
+            transformPoints(scene.top(), p, p, 3);
+            for (int i = 0; i < 3; i++)
+                p[i].normalize();
+            out1->write(p);
+            transformPoints(V, p, p, 3);
+            for (int i = 0; i < 3; i++)
+                p[i].normalize();
+            out2->write(p);
+            transformPoints(P, p, p, 3);
+        }
+        else
+        {
+            transformPoints(MVP, p, p, 3);
+        }
+        Triangle tri;
+        copy(p, p + 3, tri.points);
+        tri.color = Color(colorRand() % 256, colorRand() % 256, colorRand() % 256);
+        emit(tri, false);
+    };
+    scene.onMesh = [&](const Mesh &mesh)
+    {
+        refreshMVP();
+        vector<Point> v = mesh.vertices;
+        size_t n = v.size();
+        auto writeMesh = [&](StageWriter &out)
+        {
+            for (auto &t : mesh.triangles)
+            {
+                Point p[3] = {v[t[0]], v[t[1]], v[t[2]]};
+                out.write(p);
+            }
+        };
+        if (debugStages)
+        {
+            transformPoints(scene.top(), v.data(), v.data(), n);
+            for (Point &p : v)
+                p.normalize();
+            writeMesh(*out1);
+            transformPoints(V, v.data(), v.data(), n);
+            for (Point &p : v)
+                p.normalize();
+            writeMesh(*out2);
+            transformPoints(P, v.data(), v.data(), n);
+        }
+        else
+            transformPoints(MVP, v.data(), v.data(), n);
+        // without clipping every vertex is divided by w once, here
+        if (!opts.clip)
+            for (Point &p : v)
+                p.normalize();
+        for (auto &t : mesh.triangles)
+        {
+            Triangle tri;
+            tri.points[0] = v[t[0]];
+            tri.points[1] = v[t[1]];
+            tri.points[2] = v[t[2]];
+            tri.color = Color(colorRand() % 256, colorRand() % 256, colorRand() % 256);
+            emit(tri, !opts.clip);
+        }
+    };
+    if (opts.cull)
+    {
+        scene.isVisible = [&](const Bounds &box)
+        {
+            return boxMayBeVisible(multiply(VP, scene.top()), box, stream.sc);
+        };
+        // culled triangles still take their color, so the rest keep theirs
+        scene.onCulled = [](long long triangles)
+        {
+            for (long long i = 0; i < 3 * triangles; i++)
+                colorRand();
+        };
+    }
+    bool ok = scene.run(in);
+    if (opts.clip)
+        printClipStats(clipStats);
+    if (opts.cull)
+        cout << "cull: " << scene.groupsCulled << " groups, " << scene.trianglesCulled << " triangles skipped" << endl;
+
+    stream.finish();
+    return ok;
+}
+
+// ==== Renderer ====
+// The pipeline as a library, without files or a working directory: a scene
+// is parsed once into world-space triangles (stage 1, colors included), and
+// a Renderer runs stages 2-4 of such a scene for any camera and screen,
+// returning its render target. The target, the triangle batch and the
+// tile bins survive between calls, so a long-lived Renderer re-renders at
+// the same size without allocating. Bands and the statistics report are
+// for the file-driven pipeline only; the counters of the last frame are in
+// stats and clipStats.
+//
+//   SceneData scene = parseScene(sceneText);
+//   Renderer renderer(opts);
+//   RenderTarget &frame = renderer.render(scene.triangles, scene.camera, sc);
+//   // frame.image, frame.zBuffer
+
+// stage 1 of the whole scene into world-space triangles with their colors;
+// mesh paths are relative to dir. False if a mesh could not be loaded.
+bool worldTriangles(SceneScanner &in, vector<Triangle> &world, const string &dir = "")
+{
+    SceneInterpreter scene;
+    scene.dir = dir;
+    auto add = [&](const Point &a, const Point &b, const Point &c)
+    {
+        Triangle tri;
+        tri.points[0] = a;
+        tri.points[1] = b;
+        tri.points[2] = c;
+        tri.color = Color(colorRand() % 256, colorRand() % 256, colorRand() % 256);
+        world.push_back(tri);
+    };
+    scene.onTriangle = [&](Point p[3])
+    {
+        transformPoints(scene.top(), p, p, 3);
+        for (int i = 0; i < 3; i++)
+            p[i].normalize();
+        add(p[0], p[1], p[2]);
+    };
+    scene.onMesh = [&](const Mesh &mesh)
+    {
+        vector<Point> v = mesh.vertices;
+        transformPoints(scene.top(), v.data(), v.data(), v.size());
+        for (Point &p : v)
+            p.normalize();
+        for (auto &t : mesh.triangles)
+            add(v[t[0]], v[t[1]], v[t[2]]);
+    };
+    return scene.run(in);
+}
+
+struct SceneData
+{
+    Camera camera;
+    vector<Triangle> triangles; // world space
+    bool ok = true;             // false if a mesh could not be loaded
+};
+
+// scene.txt contents (camera header and commands) held in memory; mesh
+// commands still load their files
+SceneData parseScene(const string &text)
+{
+    SceneScanner in(text.data(), text.data() + text.size());
+    SceneData scene;
+    scene.camera = readCamera(in);
+    scene.ok = worldTriangles(in, scene.triangles);
+    return scene;
+}
+
+struct Renderer
+{
+    RenderOptions opts;
+    RenderTarget target;
+    vector<Triangle> batch;
+    TileBins bins;
+    RasterStats stats;
+    ClipStats clipStats;
+
+    explicit Renderer(const RenderOptions &opts) : opts(opts)
+    {
+        this->opts.bandRows = 0;
+    }
+
+    // stages 2-4 of world-space triangles for cam into sc; the returned
+    // target stays valid until the next call
+    RenderTarget &render(const vector<Triangle> &world, const Camera &cam, const ScreenConfig &sc)
+    {
+        prepareTarget(target, sc, opts);
+        stats = RasterStats();
+        clipStats = ClipStats();
+        Rect screen = {0, sc.height - 1, 0, sc.width - 1};
+        auto flush = [&]()
+        {
+            if (opts.triangleParallel)
+                scanConvertAtomic(batch, sc, target, opts.threads, stats);
+            else
+                scanConvertBatch(batch, sc, screen, target, opts, stats, bins);
+            batch.clear();
+        };
+
+        Mat4 VP = multiply(projectionMatrix(cam), viewMatrix(cam));
+        for (const Triangle &src : world)
+        {
+            Triangle tri = src;
+            transformPoints(VP, tri.points, tri.points, 3);
+            if (opts.clip)
+            {
+                Point pieces[7][3];
+                int count = clipTriangle(tri.points, pieces, clipStats);
+                for (int k = 0; k < count; k++)
+                {
+                    copy(pieces[k], pieces[k] + 3, tri.points);
+                    batch.push_back(tri);
+                }
+            }
+            else
+            {
+                for (int i = 0; i < 3; i++)
+                    tri.points[i].normalize();
+                batch.push_back(tri);
+            }
+            if (batch.size() >= STREAM_BATCH && opts.sort != "scene")
+                flush();
+        }
+        flush();
+        if (target.samples > 1)
+            resolveSamples(target, sc, 0, sc.height - 1, opts.threads);
+        return target;
+    }
+};
+
+// ==== Multi-Camera Rendering ====
+// Stage 1 runs once into world-space triangles kept in memory (colors drawn
+// in file order, so every view shows the same colors); stages 2-4 then run
+// per camera from the camera file, writing out_<k>.bmp. Cameras render in
+// parallel on the worker threads, and the threads left over when there are
+// fewer cameras than threads go to tile binning inside each camera.
+//
+// Camera file commands (the perspective line always comes from scene.txt):
+//   camera        eye, look and up on the next three lines: one camera
+//   orbit N D     N more cameras, each turning the previous eye D degrees
+//                 about the look point around the up vector (turntable)
+//   fly N         eye, look and up follow: N more cameras moving in equal
+//                 steps from the previous camera to this one (flythrough)
+//   end
+
+// false (with a message) on an unknown command, orbit/fly before a camera,
+// a missing number or a file without cameras
+bool readCameraFile(const string &file, const Camera &lens, vector<Camera> &cameras)
+{
+    if (!ifstream(file))
+    {
+        cerr << "cannot open camera file: " << file << "\n";
+        return false;
+    }
+    SceneScanner in(file);
+    string_view cmd;
+    auto missing = [&]
+    {
+        cerr << "camera file: " << cmd << " is missing numbers\n";
+        return false;
+    };
+    while (in.word(cmd) && cmd != "end")
+    {
+        Camera cam = lens;
+        if (cmd == "camera")
+        {
+            if (!(in.point(cam.eye) && in.point(cam.look) && in.point(cam.up)))
+                return missing();
+            cameras.push_back(cam);
+            continue;
+        }
+        if ((cmd != "orbit" && cmd != "fly") || cameras.empty())
+        {
+            cerr << "camera file: unexpected " << cmd << "\n";
+            return false;
+        }
+        Camera from = cameras.back();
+        double n = 0;
+        if (!in.number(n))
+            return missing();
+        if (cmd == "orbit")
+        {
+            double degrees = 0;
+            if (!in.number(degrees))
+                return missing();
+            for (int k = 1; k <= n; k++)
+            {
+                Mat4 R = rotationMatrix(k * degrees, from.up.x, from.up.y, from.up.z);
+                Point arm = multiply(R, Point(from.eye.x - from.look.x, from.eye.y - from.look.y, from.eye.z - from.look.z));
+                cam.eye = Point(from.look.x + arm.x, from.look.y + arm.y, from.look.z + arm.z);
+                cam.look = from.look;
+                cam.up = from.up;
+                cameras.push_back(cam);
+            }
+            continue;
+        }
+        Camera to = lens;
+        if (!(in.point(to.eye) && in.point(to.look) && in.point(to.up)))
+            return missing();
+        auto lerp = [](const Point &a, const Point &b, double t)
+        {
+            return Point(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+        };
+        for (int k = 1; k <= n; k++)
+        {
+            double t = k / n;
+            cam.eye = lerp(from.eye, to.eye, t);
+            cam.look = lerp(from.look, to.look, t);
+            cam.up = lerp(from.up, to.up, t);
+            cameras.push_back(cam);
+        }
+    }
+    if (cameras.empty())
+    {
+        cerr << "camera file: no cameras in " << file << "\n";
+        return false;
+    }
+    return true;
+}
+
+// false if the camera file cannot be used or a mesh could not be loaded
+bool multiCameraPipeline(const RenderOptions &opts)
+{
+    SceneScanner in(inDir(opts.dir, "scene.txt"));
+    Camera lens = readCamera(in);
+    vector<Camera> cameras;
+    if (!readCameraFile(opts.cameras, lens, cameras))
+        return false;
+    ScreenConfig sc = readScreenConfig(inDir(opts.dir, "config.txt"));
+    vector<Triangle> world;
+    bool ok = worldTriangles(in, world, opts.dir);
+
+    int n = cameras.size();
+    int parallel = max(1, min(opts.threads, n));
+    RenderOptions cameraOpts = opts;
+    cameraOpts.threads = max(1, opts.threads / parallel);
+    vector<ClipStats> clipStats(n);
+    parallelFor(n, parallel, [&](int k)
+    {
+        Renderer renderer(cameraOpts);
+        renderer.render(world, cameras[k], sc).image.save_image(inDir(opts.dir, "out_" + to_string(k) + ".bmp"));
+        clipStats[k] = renderer.clipStats;
+    });
+    if (opts.clip)
+    {
+        ClipStats total;
+        for (const ClipStats &c : clipStats)
+        {
+            total.in += c.in;
+            total.accepted += c.accepted;
+            total.culled += c.culled;
+            total.clipped += c.clipped;
+            total.produced += c.produced;
+        }
+        printClipStats(total);
+    }
+    cout << "cameras: " << n << " views of " << world.size() << " triangles" << endl;
+    return ok;
+}
+
+// ==== Depth Format Check ====
+// Renders the scene in opts.dir in memory twice, with a double z-buffer and
+// with the given format, and compares them pixel by pixel: the same pixels
+// must be covered and every depth must be within tolerance. The reference
+// Resources/*/z_buffer.txt files cannot serve here, since their rows
+// already differ in length from this rasterizer's double output.
+
+bool checkDepthFormat(const RenderOptions &opts, const string &format, double tolerance)
+{
+    SceneScanner in(inDir(opts.dir, "scene.txt"));
+    Camera cam = readCamera(in);
+    vector<Triangle> world;
+    if (!worldTriangles(in, world, opts.dir))
+        return false;
+    ScreenConfig sc = readScreenConfig(inDir(opts.dir, "config.txt"));
+
+    RenderOptions refOpts = opts;
+    refOpts.depthFormat = "double";
+    Renderer ref(refOpts);
+    RenderOptions curOpts = opts;
+    curOpts.depthFormat = format;
+    Renderer cur(curOpts);
+    const DepthBuffer &a = ref.render(world, cam, sc).zBuffer, &b = cur.render(world, cam, sc).zBuffer;
+
+    long long covered = 0, coverageDiffs = 0, over = 0;
+    double maxDiff = 0;
+    for (int row = 0; row < sc.height; row++)
+        for (int col = 0; col < sc.width; col++)
+        {
+            double za = a.get(row, col), zb = b.get(row, col);
+            if ((za < sc.z_rear) != (zb < sc.z_rear))
+            {
+                coverageDiffs++;
+                continue;
+            }
+            if (!(za < sc.z_rear))
+                continue;
+            covered++;
+            maxDiff = max(maxDiff, fabs(za - zb));
+            over += fabs(za - zb) > tolerance;
+        }
+    printf("%s against double: %lld covered pixels, %lld covered in only one, over %g: %lld, max |diff|: %g\n",
+           format.c_str(), covered, coverageDiffs, tolerance, over, maxDiff);
+    return coverageDiffs == 0 && over == 0;
+}
+
+// ==== Command Line ====
+
+// parses the rasterizer options (see the usage list in 2005110.cpp); prints
+// the problem and returns false on an unknown or invalid one
+bool parseRenderOptions(const vector<string> &args, RenderOptions &opts)
+{
+    bool rasterGiven = false;
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        const string &arg = args[i];
+        bool hasValue = i + 1 < args.size();
+        if (arg == "--fused")
+            opts.fused = true;
+        else if (arg == "--debug-stages")
+            opts.debugStages = true;
+        else if (arg == "--threads" && hasValue)
+            opts.threads = atoi(args[++i].c_str());
+        else if (arg == "--tile" && hasValue)
+            opts.tileSize = max(1, atoi(args[++i].c_str()));
+        else if (arg == "--raster" && hasValue)
+        {
+            opts.raster = args[++i];
+            rasterGiven = true;
+        }
+        else if (arg == "--hiz")
+            opts.hiz = true;
+        else if (arg == "--clip")
+            opts.clip = true;
+        else if (arg == "--zraw")
+            opts.zRaw = true;
+        else if (arg == "--stage-format" && hasValue)
+            opts.stageFormat = args[++i];
+        else if (arg == "--depth-format" && hasValue)
+            opts.depthFormat = args[++i];
+        else if (arg == "--stats" && hasValue)
+            opts.stats = args[++i];
+        else if (arg == "--heatmap")
+            opts.heatmap = true;
+        else if (arg == "--cull")
+            opts.cull = true;
+        else if (arg == "--cameras" && hasValue)
+            opts.cameras = args[++i];
+        else if (arg == "--msaa" && hasValue)
+            opts.msaa = atoi(args[++i].c_str());
+        else if (arg == "--band" && hasValue)
+            opts.bandRows = max(1, atoi(args[++i].c_str()));
+        else if (arg == "--triangle-parallel")
+            opts.triangleParallel = true;
+        else if (arg == "--sort" && hasValue)
+            opts.sort = args[++i];
+        else if (arg == "--prepass")
+            opts.prepass = true;
+        else
+        {
+            cerr << "unknown option: " << arg << "\n";
+            return false;
+        }
+    }
+    if (opts.raster != "scanline" && opts.raster != "halfspace" && opts.raster != "fixed")
+    {
+        cerr << "unknown raster core: " << opts.raster << "\n";
+        return false;
+    }
+    if (opts.stageFormat != "text" && opts.stageFormat != "bin" && opts.stageFormat != "bin32")
+    {
+        cerr << "unknown stage format: " << opts.stageFormat << "\n";
+        return false;
+    }
+    if (!opts.sort.empty() && opts.sort != "scene" && opts.sort != "tile")
+    {
+        cerr << "unknown sort order: " << opts.sort << "\n";
+        return false;
+    }
+    if (opts.prepass && (opts.msaa > 1 || opts.triangleParallel))
+    {
+        cerr << "--prepass does not work with --msaa or --triangle-parallel\n";
+        return false;
+    }
+    if (!opts.sort.empty() && opts.triangleParallel)
+    {
+        cerr << "--sort does not work with --triangle-parallel\n";
+        return false;
+    }
+    if (opts.depthFormat != "double" && opts.depthFormat != "float32" && opts.depthFormat != "unorm24")
+    {
+        cerr << "unknown depth format: " << opts.depthFormat << "\n";
+        return false;
+    }
+    if (!opts.stats.empty() && opts.stats != "json" && opts.stats != "csv")
+    {
+        cerr << "unknown stats format: " << opts.stats << "\n";
+        return false;
+    }
+    if (opts.cull && !opts.fused)
+    {
+        cerr << "--cull needs --fused (stage 4 colors are assigned after the stage files)\n";
+        return false;
+    }
+    if (opts.cull && opts.debugStages)
+    {
+        cerr << "--cull leaves culled triangles out of the stage files, drop --debug-stages\n";
+        return false;
+    }
+    if (!opts.cameras.empty() && (opts.fused || opts.debugStages || opts.cull || opts.zRaw || !opts.stats.empty() ||
+                                  opts.heatmap || opts.stageFormat != "text"))
+    {
+        cerr << "--cameras only writes out_<k>.bmp; it takes --threads, --tile, --raster, --hiz, --clip, --msaa, "
+                "--depth-format, --sort and --prepass\n";
+        return false;
+    }
+    if (opts.msaa != 1 && opts.msaa != 2 && opts.msaa != 4 && opts.msaa != 8)
+    {
+        cerr << "--msaa takes 1, 2, 4 or 8 samples\n";
+        return false;
+    }
+    if (opts.bandRows > 0 && (opts.hiz || opts.heatmap || !opts.cameras.empty()))
+    {
+        cerr << "--band does not work with --hiz, --heatmap or --cameras\n";
+        return false;
+    }
+    if (opts.triangleParallel && (opts.hiz || opts.msaa > 1 || opts.bandRows > 0 || opts.heatmap || !opts.cameras.empty()))
+    {
+        cerr << "--triangle-parallel does not work with --hiz, --msaa, --band, --heatmap or --cameras\n";
+        return false;
+    }
+    if (opts.triangleParallel && rasterGiven && opts.raster != "fixed")
+    {
+        cerr << "--triangle-parallel always uses the fixed-point core; drop --raster " << opts.raster << "\n";
+        return false;
+    }
+    if (opts.msaa > 1 && opts.hiz)
+    {
+        cerr << "--hiz bounds pixel depths and does not work with --msaa\n";
+        return false;
+    }
+    if (opts.threads <= 0)
+        opts.threads = max(1u, thread::hardware_concurrency());
+    if (opts.hiz && opts.threads > 1 && opts.tileSize % BLOCK != 0)
+    {
+        cerr << "--hiz with --threads needs a tile size that is a multiple of " << BLOCK << "\n";
+        return false;
+    }
+    return true;
+}
+
+// runs the whole pipeline on scene.txt and config.txt in opts.dir; false
+// (after a message) if an input is missing or could not be read. A scene
+// with an unreadable mesh is still rendered without it.
+bool runPipeline(const RenderOptions &opts)
+{
+    pipelineStats = PipelineStats();
+    for (const char *name : {"scene.txt", "config.txt"})
+        if (!ifstream(inDir(opts.dir, name)))
+        {
+            cerr << "cannot open " << inDir(opts.dir, name) << "\n";
+            return false;
+        }
+    bool ok = true;
+    if (!opts.cameras.empty())
+        timeStage("cameras", [&] { ok = multiCameraPipeline(opts); });
+    else if (opts.fused)
+        timeStage("fused", [&] { ok = fusedPipeline(opts); });
+    else
+    {
+        timeStage("stage1", [&] { ok = stage1(opts) && ok; });
+        timeStage("stage2", [&] { ok = stage2(opts) && ok; });
+        timeStage("stage3", [&] { ok = stage3(opts) && ok; });
+        timeStage("stage4", [&] { ok = stage4(opts) && ok; });
+    }
+    if (!opts.stats.empty())
+        writeStatsReport(pipelineStats, opts.stats, opts.dir);
+    return ok;
+}
+
+// ==== Batch Driver ====
+// Renders many scene directories in one process: jobs workers take the
+// directories in list order, each running the whole pipeline with that
+// directory as opts.dir (outputs land next to the scene). Before a job
+// starts, its memory is estimated from the screen size and options (and a
+// quick triangle count when the options hold the whole scene), and it
+// waits until the estimates of the running jobs leave room for it under the
+// budget (a job over the budget on its own runs alone). --threads is the
+// total for the batch: each job gets its share. Every worker has its
+// own color generator and statistics, so each directory renders exactly as
+// a separate run would.
+
+struct BatchJob
+{
+    string dir;
+    bool ok = false;
+    double seconds = 0;
+    long long triangles = 0, pixels = 0;
+    size_t bytes = 0;
+};
+
+// directories, one per line; blank lines and lines starting with # are skipped
+bool readBatchList(const string &file, vector<string> &dirs)
+{
+    ifstream in(file);
+    if (!in)
+    {
+        cerr << "cannot open batch list: " << file << "\n";
+        return false;
+    }
+    string line;
+    while (getline(in, line))
+    {
+        size_t a = line.find_first_not_of(" \t\r"), b = line.find_last_not_of(" \t\r");
+        if (a != string::npos && line[a] != '#')
+            dirs.push_back(line.substr(a, b - a + 1));
+    }
+    return true;
+}
+
+// rough triangle count of the scene in dir: triangle commands, plus mesh
+// files at one triangle per 16 bytes (instances are not expanded)
+long long estimateSceneTriangles(const string &dir)
+{
+    SceneScanner in(inDir(dir, "scene.txt"));
+    long long triangles = 0;
+    string_view w;
+    while (in.word(w))
+        if (w == "triangle")
+            triangles++;
+        else if (w == "mesh" && in.word(w))
+        {
+            ifstream mesh(inDir(dir, string(w)), ios::binary | ios::ate);
+            if (mesh)
+                triangles += (long long)mesh.tellg() / 16;
+        }
+    return triangles;
+}
+
+// rough peak memory of one job: render targets, samples, the stream batch
+// and, where the whole scene is held (bands, --sort scene, --cameras), its
+// triangles
+size_t estimateJobBytes(const ScreenConfig &sc, const RenderOptions &opts)
+{
+    size_t rows = opts.bandRows > 0 ? min(sc.height, opts.bandRows) : sc.height;
+    size_t pixels = (size_t)sc.width * rows;
+    size_t perPixel = depthBytes(depthFormatOf(opts.depthFormat)) + 3;
+    if (opts.msaa > 1)
+        perPixel += (sizeof(float) + sizeof(uint32_t)) * opts.msaa;
+    if (opts.heatmap)
+        perPixel += sizeof(uint32_t);
+    size_t targets = opts.cameras.empty() ? 1 : opts.threads; // cameras render in parallel
+    size_t bytes = targets * (pixels * perPixel + STREAM_BATCH * sizeof(Triangle)) + (16 << 20);
+
+    size_t perTriangle = 0;
+    if (opts.bandRows > 0)
+        perTriangle += sizeof(Triangle) + sizeof(uint32_t); // kept and its band lists
+    if (opts.sort == "scene")                                // batch, sort keys, order and sorted copy
+        perTriangle += targets * (2 * sizeof(Triangle) + sizeof(uint16_t) + 2 * sizeof(int));
+    if (!opts.cameras.empty())
+        perTriangle += sizeof(Triangle); // world-space scene
+    if (perTriangle)
+        bytes += perTriangle * estimateSceneTriangles(opts.dir);
+    return bytes;
+}
+
+// false if a directory failed
+bool runBatch(const vector<string> &dirs, const RenderOptions &opts, int jobs, size_t memoryBudget)
+{
+    int n = dirs.size();
+    vector<BatchJob> results(n);
+    mutex m;
+    condition_variable memoryFreed;
+    size_t inUse = 0;
+    auto start = chrono::steady_clock::now();
+    // --threads is shared out between the jobs running at once
+    int jobThreads = max(1, opts.threads / max(1, min(jobs, n)));
+
+    parallelFor(n, jobs, [&](int k)
+    {
+        BatchJob &job = results[k];
+        job.dir = dirs[k];
+        RenderOptions jobOpts = opts;
+        jobOpts.dir = dirs[k];
+        jobOpts.threads = jobThreads;
+        if (!ifstream(inDir(job.dir, "scene.txt")) || !ifstream(inDir(job.dir, "config.txt")))
+        {
+            cerr << job.dir << ": no scene.txt or config.txt\n";
+            return;
+        }
+        ScreenConfig sc = readScreenConfig(inDir(job.dir, "config.txt"));
+        job.pixels = (long long)sc.width * sc.height;
+        job.bytes = estimateJobBytes(sc, jobOpts);
+        {
+            unique_lock<mutex> lock(m);
+            memoryFreed.wait(lock, [&] { return inUse == 0 || inUse + job.bytes <= memoryBudget; });
+            inUse += job.bytes;
+        }
+        ColorRandom colors;
+        jobColors = &colors;
+        auto jobStart = chrono::steady_clock::now();
+        try
+        {
+            job.ok = runPipeline(jobOpts);
+        }
+        catch (const exception &e)
+        {
+            cerr << job.dir << ": " << e.what() << "\n";
+        }
+        job.seconds = secondsSince(jobStart);
+        job.triangles = pipelineStats.trianglesIn;
+        jobColors = nullptr;
+        {
+            lock_guard<mutex> lock(m);
+            inUse -= job.bytes;
+        }
+        memoryFreed.notify_all();
+    });
+
+    double wall = secondsSince(start);
+    int failed = 0;
+    long long triangles = 0, pixels = 0;
+    double busy = 0;
+    for (const BatchJob &job : results)
+    {
+        failed += !job.ok;
+        triangles += job.triangles;
+        pixels += job.ok ? job.pixels : 0;
+        busy += job.seconds;
+    }
+    cout << fixed << setprecision(3);
+    cout << "batch: " << n - failed << " of " << n << " scenes in " << wall << " s on " << min(jobs, max(n, 1))
+         << " workers (" << busy << " s of job time)\n";
+    cout << "batch: " << (n - failed) / wall << " scenes/s, " << triangles / wall << " triangles/s, "
+         << pixels / wall << " pixels/s" << endl;
+    for (const BatchJob &job : results)
+        if (!job.ok)
+            cout << "failed: " << job.dir << "\n";
+    return failed == 0;
+}
+
+#endif